@@ -37,7 +37,7 @@ func main() {
 			fmt.Printf("\n")
 		}
 		if len(qevs) == 0 {
-			err = queue.Block()
+			err = queue.Block(-1)
 			if err != nil {
 				panic(err)
 			}
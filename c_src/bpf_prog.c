@@ -2,6 +2,8 @@
 
 #include <bpf/bpf_helpers.h>
 
+#include "EbpfEventProto.h"
+
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
 struct {
@@ -9,4 +11,337 @@ struct {
 	__uint(max_entries, 1 << 22); // 4 MiB
 } ringbuf SEC(".maps");
 
+/*
+ * QQ_RINGBUF_PERCPU and QQ_RINGBUF_PERNODE, bpf_queue_open() creates the rings
+ * and points each cpu slot to the ring it should use, cpus of the same node
+ * share one. The inner map is just the template, it's resized to ringbuf_size.
+ */
+struct ringbuf_inner {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 1 << 22);
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, 1);		/* resized to the number of cpus */
+	__type(key, u32);
+	__array(values, struct ringbuf_inner);
+} ringbuf_pcpu SEC(".maps");
+
+const volatile u32 quark_ringbuf_pcpu;
+
+/*
+ * Kernel side filters, an event about a task matching any of them is dropped
+ * before it reaches the ring. Bits of quark_filter_mask are 1 << QUARK_FILTER_*
+ * from quark.h, so we only look at maps that have something in them.
+ */
+#define QUARK_FILTER_PID	1
+#define QUARK_FILTER_TGID	2
+#define QUARK_FILTER_UID	3
+#define QUARK_FILTER_COMM	4
+#define QUARK_FILTER_CGROUP	5
+#define QUARK_FILTER_MAX	1024
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, QUARK_FILTER_MAX);
+	__type(key, u32);
+	__type(value, u8);
+} quark_filter_pid SEC(".maps"), quark_filter_tgid SEC(".maps"),
+    quark_filter_uid SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, QUARK_FILTER_MAX);
+	__type(key, u64);
+	__type(value, u8);
+} quark_filter_cgroup SEC(".maps");
+
+struct quark_comm_key {
+	u32	prefixlen;	/* in bits */
+	char	comm[TASK_COMM_LEN];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, QUARK_FILTER_MAX);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct quark_comm_key);
+	__type(value, u8);
+} quark_filter_comm SEC(".maps");
+
+/* Dropped events, per cpu */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, u32);
+	__type(value, u64);
+} quark_filter_stats SEC(".maps");
+
+const volatile u32 quark_filter_mask;
+
+static int
+quark_filtered(struct ebpf_event_header *hdr)
+{
+	struct ebpf_process_fork_event	*fork;
+	struct ebpf_process_exec_event	*exec;
+	struct ebpf_process_exit_event	*exit;
+	struct ebpf_pid_info		*pids;
+	struct quark_comm_key		 ckey;
+	char				*comm;
+	u32				 uid;
+	u64				 cgroup;
+
+	switch (hdr->type) {
+	case EBPF_EVENT_PROCESS_FORK:
+		fork = (struct ebpf_process_fork_event *)hdr;
+		pids = &fork->child_pids;
+		uid = fork->creds.ruid;
+		comm = fork->comm;
+		break;
+	case EBPF_EVENT_PROCESS_EXEC:
+		exec = (struct ebpf_process_exec_event *)hdr;
+		pids = &exec->pids;
+		uid = exec->creds.ruid;
+		comm = exec->comm;
+		break;
+	case EBPF_EVENT_PROCESS_EXIT:
+		exit = (struct ebpf_process_exit_event *)hdr;
+		pids = &exit->pids;
+		uid = exit->creds.ruid;
+		comm = exit->comm;
+		break;
+	default:
+		return (0);
+	}
+
+	if ((quark_filter_mask & (1 << QUARK_FILTER_PID)) &&
+	    bpf_map_lookup_elem(&quark_filter_pid, &pids->tid) != NULL)
+		return (1);
+	if ((quark_filter_mask & (1 << QUARK_FILTER_TGID)) &&
+	    bpf_map_lookup_elem(&quark_filter_tgid, &pids->tgid) != NULL)
+		return (1);
+	if ((quark_filter_mask & (1 << QUARK_FILTER_UID)) &&
+	    bpf_map_lookup_elem(&quark_filter_uid, &uid) != NULL)
+		return (1);
+	if (quark_filter_mask & (1 << QUARK_FILTER_COMM)) {
+		ckey.prefixlen = TASK_COMM_LEN * 8;
+		__builtin_memcpy(ckey.comm, comm, sizeof(ckey.comm));
+		if (bpf_map_lookup_elem(&quark_filter_comm, &ckey) != NULL)
+			return (1);
+	}
+	/* On fork we run as the parent, the child is still in its cgroup */
+	if (quark_filter_mask & (1 << QUARK_FILTER_CGROUP)) {
+		cgroup = bpf_get_current_cgroup_id();
+		if (bpf_map_lookup_elem(&quark_filter_cgroup, &cgroup) != NULL)
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * QQ_LAZY_WAKEUP, set by bpf_queue_open(). Submit without waking up the reader
+ * unless the ring is past quark_wakeup_bytes, or we haven't woken it up for
+ * quark_wakeup_ns. Whatever is left below the threshold once the storm is over
+ * is picked up when the reader times out.
+ */
+const volatile u64 quark_wakeup_bytes;
+const volatile u64 quark_wakeup_ns;
+u64 quark_last_wakeup;
+
+static long
+quark_ringbuf_output_lazy(void *rb, void *data, u64 size, u64 flags)
+{
+	u64	now;
+
+	now = bpf_ktime_get_ns();
+	if (bpf_ringbuf_query(rb, BPF_RB_AVAIL_DATA) + size >=
+	    quark_wakeup_bytes || now - quark_last_wakeup >= quark_wakeup_ns) {
+		/* Racy across cpus, at worst we wake up twice */
+		quark_last_wakeup = now;
+		flags |= BPF_RB_FORCE_WAKEUP;
+	} else
+		flags |= BPF_RB_NO_WAKEUP;
+
+	return (bpf_ringbuf_output(rb, data, size, flags));
+}
+
+/*
+ * Filter, pick the ring and decide on waking up the reader. A filtered event
+ * still looks sent to ebpf_ringbuf_write(), bpf_queue_update_stats() takes
+ * them out. Nothing calls it by name, it's only reached through the
+ * bpf_ringbuf_output define below, make sure that still holds.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Wunused-function"
+static long
+quark_ringbuf_output(void *rb, void *data, u64 size, u64 flags)
+{
+	void	*rb_cpu;
+	u64	*dropped;
+	u32	 key;
+
+	if (quark_filter_mask && quark_filtered(data)) {
+		key = 0;
+		dropped = bpf_map_lookup_elem(&quark_filter_stats, &key);
+		if (dropped != NULL)
+			(*dropped)++;
+		return (0);
+	}
+	if (quark_ringbuf_pcpu) {
+		key = bpf_get_smp_processor_id();
+		rb_cpu = bpf_map_lookup_elem(&ringbuf_pcpu, &key);
+		if (rb_cpu != NULL)
+			rb = rb_cpu;
+	}
+	if (quark_wakeup_bytes == 0)
+		return (bpf_ringbuf_output(rb, data, size, flags));
+
+	return (quark_ringbuf_output_lazy(rb, data, size, flags));
+}
+#pragma GCC diagnostic pop
+
+/*
+ * Variable length fields the probes should build, bits are
+ * 1 << EBPF_VL_FIELD_*, set by bpf_queue_open() from the field mask. Resolving
+ * a path or copying argv is most of the cost of an event, and we never look at
+ * the env or the cgroup path.
+ */
+const volatile u32 quark_vl_mask;
+
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+/*
+ * ebpf_ringbuf_write() from Helpers.h is what the probes go through, it must
+ * see the define before Helpers.h is first included, the include guard keeps
+ * Probe.bpf.c from expanding it again.
+ */
+#define bpf_ringbuf_output	quark_ringbuf_output
+#include "Helpers.h"
+#undef bpf_ringbuf_output
+#include "PathResolver.h"
+#include "Varlen.h"
+
+#define QUARK_VL_WANTED(_t)	(quark_vl_mask & (1 << (_t)))
+
+static long
+quark_argv__fill(char *buf, size_t buf_size, const struct task_struct *task)
+{
+	if (!QUARK_VL_WANTED(EBPF_VL_FIELD_ARGV))
+		return (0);
+
+	return (ebpf_argv__fill(buf, buf_size, task));
+}
+
+static long
+quark_env__fill(char *buf, size_t buf_size, const struct task_struct *task)
+{
+	if (!QUARK_VL_WANTED(EBPF_VL_FIELD_ENV))
+		return (0);
+
+	return (ebpf_env__fill(buf, buf_size, task));
+}
+
+/* The probes only use it for the cwd */
+static size_t
+quark_resolve_cwd(char *buf, struct path *path, const struct task_struct *task)
+{
+	if (!QUARK_VL_WANTED(EBPF_VL_FIELD_CWD))
+		return (0);
+
+	return (ebpf_resolve_path_to_string(buf, path, task));
+}
+
+static size_t
+quark_resolve_cgroup(char *buf, const struct task_struct *task)
+{
+	if (!QUARK_VL_WANTED(EBPF_VL_FIELD_PIDS_SS_CGROUP_PATH))
+		return (0);
+
+	return (ebpf_resolve_pids_ss_cgroup_path_to_string(buf, task));
+}
+
+/*
+ * An unwanted field is taken back out, so it costs no ring space, the next one
+ * is added over it.
+ */
+static void
+quark_vl_field__set_size(struct ebpf_varlen_fields_start *vl_fields,
+    struct ebpf_varlen_field *field, size_t size)
+{
+	if (!QUARK_VL_WANTED(field->type)) {
+		vl_fields->nfields--;
+		return;
+	}
+
+	ebpf_vl_field__set_size(vl_fields, field, size);
+}
+
+#define ebpf_argv__fill					quark_argv__fill
+#define ebpf_env__fill					quark_env__fill
+#define ebpf_resolve_path_to_string			quark_resolve_cwd
+#define ebpf_resolve_pids_ss_cgroup_path_to_string	quark_resolve_cgroup
+#define ebpf_vl_field__set_size				quark_vl_field__set_size
+
 #include "Process/Probe.bpf.c"
+
+#undef ebpf_vl_field__set_size
+#undef ebpf_resolve_pids_ss_cgroup_path_to_string
+#undef ebpf_resolve_path_to_string
+#undef ebpf_env__fill
+#undef ebpf_argv__fill
+
+/*
+ * Snapshot of the existing processes, one EBPF_EVENT_PROCESS_EXEC per thread
+ * group leader, written to the iterator seq_file and read by
+ * bpf_queue_snapshot(). Arguments can't be read from another task, userland
+ * takes them from /proc.
+ */
+SEC("iter/task")
+int
+quark_iter_task(struct bpf_iter__task *ctx)
+{
+	struct task_struct		*task = ctx->task;
+	struct ebpf_process_exec_event	*event;
+	struct ebpf_varlen_field	*field;
+	struct file			*exe;
+	long				 size;
+
+	if (task == NULL || !is_thread_group_leader(task))
+		return (0);
+	if ((event = get_event_buffer()) == NULL)
+		return (0);
+
+	event->hdr.type = EBPF_EVENT_PROCESS_EXEC;
+	event->hdr.ts = bpf_ktime_get_ns();
+	ebpf_pid_info__fill(&event->pids, task);
+	ebpf_cred_info__fill(&event->creds, task);
+	ebpf_ctty__fill(&event->ctty, task);
+	ebpf_comm__fill(event->comm, sizeof(event->comm), task);
+	event->flags = 0;
+	event->inode_nlink = 0;
+
+	ebpf_vl_fields__init(&event->vl_fields);
+	if (QUARK_VL_WANTED(EBPF_VL_FIELD_CWD)) {
+		field = ebpf_vl_field__add(&event->vl_fields,
+		    EBPF_VL_FIELD_CWD);
+		size = ebpf_resolve_path_to_string(field->data,
+		    &task->fs->pwd, task);
+		ebpf_vl_field__set_size(&event->vl_fields, field, size);
+	}
+	/* Kernel threads have no mm */
+	exe = BPF_CORE_READ(task, mm, exe_file);
+	if (exe != NULL) {
+		field = ebpf_vl_field__add(&event->vl_fields,
+		    EBPF_VL_FIELD_FILENAME);
+		size = ebpf_resolve_path_to_string(field->data, &exe->f_path,
+		    task);
+		ebpf_vl_field__set_size(&event->vl_fields, field, size);
+	}
+
+	bpf_seq_write(ctx->meta->seq, event, EVENT_SIZE(event));
+
+	return (0);
+}
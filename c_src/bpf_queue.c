@@ -4,29 +4,63 @@
 #include <sys/epoll.h>
 #include <sys/sysinfo.h>
 
+#include <bpf/bpf.h>
+
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "quark.h"
 #include "bpf_prog_skel.h"
 #include "elastic-ebpf/GPL/Events/EbpfEventProto.h"
 
+/*
+ * A ring registered with the ring_buffer manager, the first one is the shared
+ * ringbuf from the skeleton, the others are created by bpf_queue_open_rings().
+ */
+struct bpf_ring {
+	struct quark_queue	*qq;
+	int			 fd;
+	int			 cpu;		/* -1 if shared by many cpus */
+	int			 node;		/* -1 unless QQ_RINGBUF_PERNODE */
+	u64			 last_time;	/* of the newest event read */
+};
+
 struct bpf_queue {
 	struct bpf_prog		*prog;
 	struct ring_buffer	*ringbuf;
+	struct bpf_ring		*rings;
+	int			 nrings;
+	int			 next_ring;	/* first one consumed next time */
+	int			 snapshot;	/* task iterator loaded */
+};
+
+/* Same as in bpf_prog.c */
+struct quark_comm_key {
+	u32	prefixlen;	/* in bits */
+	char	comm[16];
 };
 
+/* Same as EVENT_BUFFER_SIZE, no record can be bigger */
+#define SNAPSHOT_BUFSIZE	(1 << 18)
+
 static int	bpf_queue_populate(struct quark_queue *);
 static int	bpf_queue_update_stats(struct quark_queue *);
 static void	bpf_queue_close(struct quark_queue *);
+static int	bpf_queue_snapshot(struct quark_queue *);
 
 struct quark_queue_ops queue_ops_bpf = {
 	.open	      = bpf_queue_open,
 	.populate     = bpf_queue_populate,
 	.update_stats = bpf_queue_update_stats,
 	.close	      = bpf_queue_close,
+	.snapshot     = bpf_queue_snapshot,
 };
 
 static int
@@ -39,13 +73,31 @@ libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
 }
 
 struct ebpf_ctx {
-	struct ebpf_pid_info	*pids;
-	struct ebpf_cred_info	*creds;
-	struct ebpf_tty_dev	*ctty;
-	char			*comm;
-	char			*cwd;
+	struct ebpf_pid_info		*pids;
+	struct ebpf_cred_info		*creds;
+	struct ebpf_tty_dev		*ctty;
+	char				*comm;
+	struct ebpf_varlen_field	*cwd;
 };
 
+/*
+ * Field sizes include the NUL, so we copy them as they are instead of walking
+ * them again with strcpy.
+ */
+static int
+qstr_copy_vl_field(struct qstr *qstr, struct ebpf_varlen_field *field)
+{
+	if (field->size == 0) {
+		qstr->p[0] = 0;
+		return (0);
+	}
+	if (qstr_memcpy(qstr, field->data, field->size) == -1)
+		return (-1);
+	qstr->p[field->size - 1] = 0;
+
+	return (0);
+}
+
 static void
 ebpf_ctx_to_task(struct ebpf_ctx *ebpf_ctx, struct raw_task *task)
 {
@@ -68,14 +120,14 @@ ebpf_ctx_to_task(struct ebpf_ctx *ebpf_ctx, struct raw_task *task)
 	task->tty_major = ebpf_ctx->ctty->major;
 	task->tty_minor = ebpf_ctx->ctty->minor;
 	if (ebpf_ctx->cwd != NULL)
-		qstr_strcpy(&task->cwd, ebpf_ctx->cwd);
+		qstr_copy_vl_field(&task->cwd, ebpf_ctx->cwd);
 	else
 		qstr_strcpy(&task->cwd, "(invalid)");
 	strlcpy(task->comm, ebpf_ctx->comm, sizeof(task->comm));
 }
 
 static struct raw_event *
-ebpf_events_to_raw(struct ebpf_event_header *ev)
+ebpf_events_to_raw(struct quark_queue *qq, struct ebpf_event_header *ev)
 {
 	struct raw_event		*raw;
 	struct ebpf_process_fork_event	*fork;
@@ -92,9 +144,10 @@ ebpf_events_to_raw(struct ebpf_event_header *ev)
 		fork = (struct ebpf_process_fork_event *)ev;
 		if (fork->child_pids.tid != fork->child_pids.tgid)
 			goto bad;
-		if ((raw = raw_event_alloc(RAW_WAKE_UP_NEW_TASK)) == NULL)
+		if ((raw = raw_event_alloc(qq, RAW_WAKE_UP_NEW_TASK)) == NULL)
 			goto bad;
 		raw->pid = fork->child_pids.tid;
+		raw->tid = fork->child_pids.tid;
 		raw->time = ev->ts;
 		ebpf_ctx.pids = &fork->child_pids;
 		ebpf_ctx.creds = &fork->creds;
@@ -105,7 +158,7 @@ ebpf_events_to_raw(struct ebpf_event_header *ev)
 		FOR_EACH_VARLEN_FIELD(fork->vl_fields, field) {
 			switch (field->type) {
 			case EBPF_VL_FIELD_CWD:
-				ebpf_ctx.cwd = field->data;
+				ebpf_ctx.cwd = field;
 				break;
 			default:
 				break;
@@ -118,9 +171,10 @@ ebpf_events_to_raw(struct ebpf_event_header *ev)
 		exit = (struct ebpf_process_exit_event *)ev;
 		if (exit->pids.tid != exit->pids.tgid)
 			goto bad;
-		if ((raw = raw_event_alloc(RAW_EXIT_THREAD)) == NULL)
+		if ((raw = raw_event_alloc(qq, RAW_EXIT_THREAD)) == NULL)
 			goto bad;
 		raw->pid = exit->pids.tid;
+		raw->tid = exit->pids.tid;
 		raw->time = ev->ts;
 		ebpf_ctx.pids = &exit->pids;
 		ebpf_ctx.creds = &exit->creds;
@@ -134,9 +188,10 @@ ebpf_events_to_raw(struct ebpf_event_header *ev)
 		break;
 	case EBPF_EVENT_PROCESS_EXEC:
 		exec = (struct ebpf_process_exec_event *)ev;
-		if ((raw = raw_event_alloc(RAW_EXEC)) == NULL)
+		if ((raw = raw_event_alloc(qq, RAW_EXEC)) == NULL)
 			goto bad;
 		raw->pid = exec->pids.tid;
+		raw->tid = exec->pids.tid;
 		raw->time = ev->ts;
 		raw->exec.flags |= RAW_EXEC_F_EXT;
 		ebpf_ctx.pids = &exec->pids;
@@ -148,10 +203,10 @@ ebpf_events_to_raw(struct ebpf_event_header *ev)
 		FOR_EACH_VARLEN_FIELD(exec->vl_fields, field) {
 			switch (field->type) {
 			case EBPF_VL_FIELD_CWD:
-				ebpf_ctx.cwd = field->data;
+				ebpf_ctx.cwd = field;
 				break;
 			case EBPF_VL_FIELD_FILENAME:
-				qstr_strcpy(&raw->exec.filename, field->data);
+				qstr_copy_vl_field(&raw->exec.filename, field);
 				break;
 			case EBPF_VL_FIELD_ARGV:
 				if (field->size == 0)
@@ -179,32 +234,218 @@ ebpf_events_to_raw(struct ebpf_event_header *ev)
 
 bad:
 	if (raw != NULL)
-		raw_event_free(raw);
+		raw_event_free(qq, raw);
 
 	return (NULL);
 }
 
 static int
-bpf_ringbuf_cb(void *vqq, void *vdata, size_t len)
+bpf_ringbuf_cb(void *vring, void *vdata, size_t len)
 {
-	struct quark_queue		*qq = vqq;
+	struct bpf_ring			*ring = vring;
+	struct quark_queue		*qq = ring->qq;
 	struct ebpf_event_header	*ev = vdata;
 	struct raw_event		*raw;
 
-	raw = ebpf_events_to_raw(ev);
+	/*
+	 * A ringbuffer may be shared by many cpus and events are timestamped
+	 * before they are reserved, so they're not strictly ordered, the
+	 * aggregation window covers the skew, see raw_event_watermarked().
+	 */
+	if (ev->ts > ring->last_time)
+		ring->last_time = ev->ts;
+	if (ring->cpu != -1)
+		qq->cpu_stats[ring->cpu].bytes += len;
+	raw = ebpf_events_to_raw(qq, ev);
 	if (raw != NULL)
 		raw_event_insert(qq, raw);
 
 	return (0);
 }
 
+/*
+ * The numa node of a cpu is a nodeN link in its sysfs directory, assume node 0
+ * if there's none, like on kernels without CONFIG_NUMA.
+ */
+static int
+cpu_node(int cpu)
+{
+	DIR		*dir;
+	struct dirent	*dent;
+	char		 path[PATH_MAX];
+	const char	*errstr;
+	int		 node;
+
+	if (snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d",
+	    cpu) >= (int)sizeof(path))
+		return (0);
+	if ((dir = opendir(path)) == NULL)
+		return (0);
+	node = 0;
+	while ((dent = readdir(dir)) != NULL) {
+		if (strncmp(dent->d_name, "node", 4) != 0)
+			continue;
+		node = strtonum(dent->d_name + 4, 0, INT_MAX, &errstr);
+		if (errstr == NULL)
+			break;
+		node = 0;
+	}
+	closedir(dir);
+
+	return (node);
+}
+
+/*
+ * A cpu is online unless its sysfs online file says otherwise, the boot cpu
+ * usually has none, possible cpus that aren't present have no directory.
+ */
+static int
+cpu_online(int cpu)
+{
+	char	path[PATH_MAX], buf[8];
+
+	if (snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d",
+	    cpu) >= (int)sizeof(path))
+		return (1);
+	if (access(path, F_OK) == -1)
+		return (0);
+	if (strlcat(path, "/online", sizeof(path)) >= sizeof(path))
+		return (1);
+	if (readlineat(AT_FDCWD, path, buf, sizeof(buf)) == -1)
+		return (1);
+
+	return (strcmp(buf, "0") != 0);
+}
+
+/*
+ * Create the rings for QQ_RINGBUF_PERCPU and QQ_RINGBUF_PERNODE and point each
+ * cpu slot of ringbuf_pcpu to its ring, the shared ringbuf is always the first
+ * one, the probes fall back to it if a slot is empty. Only online cpus get a
+ * ring, the ones that may be hotplugged later use the shared one.
+ */
+static int
+bpf_queue_open_rings(struct quark_queue *qq)
+{
+	struct bpf_queue	*bqq = qq->queue_be;
+	struct bpf_ring		*ring;
+	int			 cpu, node, outer_fd, i;
+
+	bqq->rings = calloc(qq->num_cpus + 1, sizeof(*bqq->rings));
+	if (bqq->rings == NULL)
+		return (-1);
+	ring = &bqq->rings[0];
+	ring->qq = qq;
+	ring->fd = bpf_map__fd(bqq->prog->maps.ringbuf);
+	ring->cpu = -1;
+	ring->node = -1;
+	bqq->nrings = 1;
+
+	if ((qq->flags & (QQ_RINGBUF_PERCPU | QQ_RINGBUF_PERNODE)) == 0)
+		return (0);
+
+	outer_fd = bpf_map__fd(bqq->prog->maps.ringbuf_pcpu);
+	for (cpu = 0; cpu < qq->num_cpus; cpu++) {
+		if (!cpu_online(cpu))
+			continue;
+		ring = NULL;
+		node = -1;
+		if (qq->flags & QQ_RINGBUF_PERNODE) {
+			node = cpu_node(cpu);
+			for (i = 1; i < bqq->nrings; i++) {
+				if (bqq->rings[i].node == node) {
+					ring = &bqq->rings[i];
+					break;
+				}
+			}
+		}
+		if (ring == NULL) {
+			ring = &bqq->rings[bqq->nrings];
+			ring->qq = qq;
+			ring->cpu = (qq->flags & QQ_RINGBUF_PERCPU) ? cpu : -1;
+			ring->node = node;
+			ring->fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF,
+			    "quark_ringbuf", 0, 0, qq->ringbuf_size, NULL);
+			if (ring->fd < 0) {
+				warn("bpf_map_create");
+				return (-1);
+			}
+			bqq->nrings++;
+			if (ring->cpu != -1)
+				qq->cpu_stats[cpu].size = qq->ringbuf_size;
+		}
+		if (bpf_map_update_elem(outer_fd, &cpu, &ring->fd, BPF_ANY)) {
+			warn("bpf_map_update_elem");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Fill the filter maps, the probes only look at the ones in quark_filter_mask,
+ * which was set before loading.
+ */
+static int
+bpf_queue_set_filters(struct quark_queue *qq)
+{
+	struct bpf_queue	*bqq = qq->queue_be;
+	struct quark_filter	*f;
+	struct quark_comm_key	 ckey;
+	struct bpf_map		*map;
+	const void		*key;
+	size_t			 key_size, len;
+	u8			 one = 1;
+	int			 i;
+
+	for (i = 0; i < qq->nfilters; i++) {
+		f = &qq->filters[i];
+		key = &f->id;
+		key_size = sizeof(f->id);
+		switch (f->type) {
+		case QUARK_FILTER_PID:
+			map = bqq->prog->maps.quark_filter_pid;
+			break;
+		case QUARK_FILTER_TGID:
+			map = bqq->prog->maps.quark_filter_tgid;
+			break;
+		case QUARK_FILTER_UID:
+			map = bqq->prog->maps.quark_filter_uid;
+			break;
+		case QUARK_FILTER_CGROUP:
+			map = bqq->prog->maps.quark_filter_cgroup;
+			key = &f->cgroup;
+			key_size = sizeof(f->cgroup);
+			break;
+		case QUARK_FILTER_COMM:
+			map = bqq->prog->maps.quark_filter_comm;
+			bzero(&ckey, sizeof(ckey));
+			len = strnlen(f->comm, sizeof(f->comm));
+			memcpy(ckey.comm, f->comm, len);
+			ckey.prefixlen = len * 8;
+			key = &ckey;
+			key_size = sizeof(ckey);
+			break;
+		default:
+			return (errno = EINVAL, -1);
+		}
+		if (bpf_map__update_elem(map, key, key_size, &one, sizeof(one),
+		    BPF_ANY)) {
+			warn("bpf_map__update_elem");
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
 int
 bpf_queue_open(struct quark_queue *qq)
 {
 	struct bpf_queue	*bqq;
 	struct ring_buffer_opts	 ringbuf_opts;
 	struct bpf_program	*bp;
-	int			 error;
+	int			 error, pcpu, shared_size, i;
 
 	if ((qq->flags & QQ_EBPF) == 0)
 		return (errno = ENOTSUP, -1);
@@ -215,7 +456,19 @@ bpf_queue_open(struct quark_queue *qq)
 		return (-1);
 
 	qq->queue_be = bqq;
+	bqq->snapshot = (qq->flags & QQ_BPF_SNAPSHOT) != 0;
+
+	/* Must match the size of the percpu ringbuf_stats map */
+	qq->num_cpus = libbpf_num_possible_cpus();
+	if (qq->num_cpus <= 0) {
+		qq->num_cpus = 0;
+		goto fail;
+	}
+	qq->cpu_stats = calloc(qq->num_cpus, sizeof(*qq->cpu_stats));
+	if (qq->cpu_stats == NULL)
+		goto fail;
 
+again:
 	bqq->prog = bpf_prog__open();
 	if (bqq->prog == NULL) {
 		warn("bpf_prog__open");
@@ -233,6 +486,11 @@ bpf_queue_open(struct quark_queue *qq)
 	bpf_program__set_autoload(bqq->prog->progs.sched_process_fork, 1);
 	bpf_program__set_autoload(bqq->prog->progs.sched_process_exec, 1);
 	bpf_program__set_autoload(bqq->prog->progs.kprobe__taskstats_exit, 1);
+	/* The iterator is run once by bpf_queue_snapshot(), not attached */
+	if (bqq->snapshot) {
+		bpf_program__set_autoload(bqq->prog->progs.quark_iter_task, 1);
+		bpf_program__set_autoattach(bqq->prog->progs.quark_iter_task, 0);
+	}
 
 	error = bpf_map__set_max_entries(bqq->prog->maps.event_buffer_map,
 	    get_nprocs_conf());
@@ -240,29 +498,105 @@ bpf_queue_open(struct quark_queue *qq)
 		warn("bpf_map__set_max_entries");
 		goto fail;
 	}
+	/*
+	 * With per-cpu rings the shared one is only a fallback and is kept
+	 * minimal, unless some cpus are offline and would use it if plugged,
+	 * otherwise it's the per-cpu slots and their template that are
+	 * minimal, the kernel creates the template on load.
+	 */
+	pcpu = (qq->flags & (QQ_RINGBUF_PERCPU | QQ_RINGBUF_PERNODE)) != 0;
+	shared_size = qq->ringbuf_size;
+	if (pcpu) {
+		shared_size = getpagesize();
+		for (i = 0; i < qq->num_cpus; i++) {
+			if (!cpu_online(i)) {
+				shared_size = qq->ringbuf_size;
+				break;
+			}
+		}
+	}
+	error = bpf_map__set_max_entries(bqq->prog->maps.ringbuf,
+	    shared_size);
+	if (error == 0)
+		error = bpf_map__set_max_entries(bqq->prog->maps.ringbuf_pcpu,
+		    pcpu ? qq->num_cpus : 1);
+	if (error == 0)
+		error = bpf_map__set_max_entries(
+		    bpf_map__inner_map(bqq->prog->maps.ringbuf_pcpu),
+		    pcpu ? qq->ringbuf_size : getpagesize());
+	if (error != 0) {
+		warn("bpf_map__set_max_entries");
+		goto fail;
+	}
+	bqq->prog->rodata->quark_ringbuf_pcpu = pcpu;
+	for (i = 0; i < qq->nfilters; i++)
+		bqq->prog->rodata->quark_filter_mask |=
+		    1 << qq->filters[i].type;
+	bqq->prog->rodata->quark_vl_mask = 1 << EBPF_VL_FIELD_FILENAME;
+	if (qq->field_mask & QUARK_F_CWD)
+		bqq->prog->rodata->quark_vl_mask |= 1 << EBPF_VL_FIELD_CWD;
+	if (qq->field_mask & QUARK_F_CMDLINE)
+		bqq->prog->rodata->quark_vl_mask |= 1 << EBPF_VL_FIELD_ARGV;
+	/*
+	 * There doesn't seem to be a watermark setting for ebpf, so the probes
+	 * decide when to wake us up, see quark_ringbuf_output().
+	 */
+	if (qq->flags & QQ_LAZY_WAKEUP) {
+		bqq->prog->rodata->quark_wakeup_bytes = max(1ULL,
+		    ((u64)qq->ringbuf_size * qq->ring_wakeup) / 100);
+		bqq->prog->rodata->quark_wakeup_ns =
+		    MS_TO_NS(qq->hold_time) / 10;
+		if (qq->flags & QQ_WATERMARK)
+			bqq->prog->rodata->quark_wakeup_ns = min(
+			    bqq->prog->rodata->quark_wakeup_ns, qq->agg_window);
+		/* What's left below the threshold must be picked up by us */
+		qq->ring_tick = max(bqq->prog->rodata->quark_wakeup_ns,
+		    MS_TO_NS(1));
+	}
 
 	error = bpf_prog__load(bqq->prog);
+	if (error && bqq->snapshot) {
+		/*
+		 * Older kernels have no task iterators, a failed load can't
+		 * be retried so start over without it, quark_queue_open()
+		 * falls back to scraping /proc.
+		 */
+		warnx("%s: can't load task iterator, snapshot disabled",
+		    __func__);
+		bpf_prog__destroy(bqq->prog);
+		bqq->prog = NULL;
+		bqq->snapshot = 0;
+		goto again;
+	}
 	if (error) {
 		warn("bpf_prog__load");
 		goto fail;
 	}
 
+	/* Rings and filters must be in place before we attach */
+	if (bpf_queue_open_rings(qq) == -1 || bpf_queue_set_filters(qq) == -1)
+		goto fail;
+
 	error = bpf_prog__attach(bqq->prog);
 	if (error) {
 		warn("bpf_prog__attach");
 		goto fail;
 	}
 
-	/*
-	 * There doesn't seem to be a watermark setting for ebpf!
-	 */
 	ringbuf_opts.sz = sizeof(ringbuf_opts);
-	bqq->ringbuf = ring_buffer__new(bpf_map__fd(bqq->prog->maps.ringbuf),
-	    bpf_ringbuf_cb, qq, &ringbuf_opts);
+	bqq->ringbuf = ring_buffer__new(bqq->rings[0].fd, bpf_ringbuf_cb,
+	    &bqq->rings[0], &ringbuf_opts);
 	if (bqq->ringbuf == NULL) {
 		warn("ring_buffer__new");
 		goto fail;
 	}
+	for (i = 1; i < bqq->nrings; i++) {
+		if (ring_buffer__add(bqq->ringbuf, bqq->rings[i].fd,
+		    bpf_ringbuf_cb, &bqq->rings[i]) < 0) {
+			warn("ring_buffer__add");
+			goto fail;
+		}
+	}
 
 	qq->epollfd = ring_buffer__epoll_fd(bqq->ringbuf);
 	if (qq->epollfd < 0)
@@ -281,35 +615,162 @@ static int
 bpf_queue_populate(struct quark_queue *qq)
 {
 	struct bpf_queue	*bqq = qq->queue_be;
-	int			 npop, space_left;
+	struct bpf_ring		*ring;
+	struct ring		*r;
+	size_t			 avail;
+	int			 npop, n, space_left, i;
+	u64			 start, wm;
 
 	space_left = qq->length >= qq->max_length ?
 	    0 : qq->max_length - qq->length;
 	if (space_left == 0)
 		return (0);
 
-	npop = ring_buffer__consume_n(bqq->ringbuf, space_left);
+	/*
+	 * Consume each ring in turn and start with a different one every time,
+	 * otherwise a full queue would starve the last ones.
+	 */
+	start = (qq->flags & QQ_WATERMARK) ? now64() : 0;
+	npop = 0;
+	for (i = 0; i < bqq->nrings && npop < space_left; i++) {
+		r = ring_buffer__ring(bqq->ringbuf,
+		    (bqq->next_ring + i) % bqq->nrings);
+		if ((n = ring__consume_n(r, space_left - npop)) < 0)
+			return (-1);
+		npop += n;
+	}
+	bqq->next_ring = (bqq->next_ring + 1) % bqq->nrings;
 
-	return (npop < 0 ? -1 : npop);
+	/*
+	 * A drained ring can't hold anything older than when we started,
+	 * otherwise it may hold anything newer than the last event we read
+	 * from it, the watermark is the oldest of those.
+	 */
+	wm = (u64)-1;
+	for (i = 0; i < bqq->nrings; i++) {
+		ring = &bqq->rings[i];
+		r = ring_buffer__ring(bqq->ringbuf, i);
+		avail = ring__avail_data_size(r);
+		if (ring->cpu != -1)
+			qq->cpu_stats[ring->cpu].fill = avail;
+		wm = min(wm, avail == 0 ? start : ring->last_time);
+	}
+	if (qq->flags & QQ_WATERMARK)
+		qq->watermark = wm;
+
+	return (npop);
+}
+
+/*
+ * Run the task iterator once and feed what it finds to the process cache, each
+ * record is an ebpf_process_exec_event as produced by quark_iter_task, they may
+ * be split across reads.
+ */
+static int
+bpf_queue_snapshot(struct quark_queue *qq)
+{
+	struct bpf_queue		*bqq = qq->queue_be;
+	struct bpf_link			*link;
+	struct ebpf_process_exec_event	*exec;
+	struct raw_event		*raw;
+	char				*buf;
+	size_t				 len, off, evlen;
+	ssize_t				 n;
+	int				 fd, ret;
+
+	if (!bqq->snapshot)
+		return (errno = ENOTSUP, -1);
+	link = bpf_program__attach_iter(bqq->prog->progs.quark_iter_task,
+	    NULL);
+	if (link == NULL)
+		return (-1);
+	if ((fd = bpf_iter_create(bpf_link__fd(link))) < 0) {
+		bpf_link__destroy(link);
+		return (-1);
+	}
+	if ((buf = malloc(SNAPSHOT_BUFSIZE)) == NULL) {
+		close(fd);
+		bpf_link__destroy(link);
+		return (-1);
+	}
+
+	ret = -1;
+	len = 0;
+	for (; ;) {
+		n = qread(fd, buf + len, SNAPSHOT_BUFSIZE - len);
+		if (n == -1)
+			goto done;
+		if (n == 0)
+			break;
+		len += n;
+		for (off = 0; len - off >= sizeof(*exec); off += evlen) {
+			exec = (struct ebpf_process_exec_event *)(buf + off);
+			evlen = sizeof(*exec) + exec->vl_fields.size;
+			if (evlen > SNAPSHOT_BUFSIZE) {
+				warnx("%s: bogus record size %zu", __func__,
+				    evlen);
+				errno = EBADMSG;
+				goto done;
+			}
+			if (len - off < evlen)
+				break;
+			raw = ebpf_events_to_raw(qq, &exec->hdr);
+			if (raw == NULL)
+				continue;
+			if (raw_event_snapshot(qq, raw) == -1)
+				warnx("can't snapshot %d", raw->pid);
+			raw_event_free(qq, raw);
+		}
+		len -= off;
+		memmove(buf, buf + off, len);
+	}
+	if (len != 0) {
+		warnx("%s: truncated record", __func__);
+		errno = EBADMSG;
+		goto done;
+	}
+	ret = 0;
+done:
+	free(buf);
+	close(fd);
+	bpf_link__destroy(link);
+
+	return (ret);
 }
 
 static int
 bpf_queue_update_stats(struct quark_queue *qq)
 {
 	struct bpf_queue	*bqq  = qq->queue_be;
-	struct ebpf_event_stats	 pcpu_ees[libbpf_num_possible_cpus()];
+	struct ebpf_event_stats	 pcpu_ees[qq->num_cpus];
+	u64			 pcpu_filtered[qq->num_cpus];
 	u32			 zero = 0;
 	int			 i;
 
 	/* valgrind doesn't track that this will be updated below */
 	bzero(pcpu_ees, sizeof(pcpu_ees));
+	bzero(pcpu_filtered, sizeof(pcpu_filtered));
 
 	if (bpf_map__lookup_elem(bqq->prog->maps.ringbuf_stats, &zero,
 	    sizeof(zero), pcpu_ees, sizeof(pcpu_ees), 0) != 0)
 		return (-1);
+	if (bpf_map__lookup_elem(bqq->prog->maps.quark_filter_stats, &zero,
+	    sizeof(zero), pcpu_filtered, sizeof(pcpu_filtered), 0) != 0)
+		return (-1);
 
-	for (i = 0; i < libbpf_num_possible_cpus(); i++)
-		qq->stats.lost = pcpu_ees[i].lost;
+	/*
+	 * The counters are per producing cpu, unless each cpu has its own
+	 * ring, bytes, fill and size can't be told apart and are left at zero.
+	 * Filtered events count as sent for the probes, take them out.
+	 */
+	qq->stats.lost = 0;
+	qq->stats.filtered = 0;
+	for (i = 0; i < qq->num_cpus; i++) {
+		qq->stats.lost += pcpu_ees[i].lost;
+		qq->stats.filtered += pcpu_filtered[i];
+		qq->cpu_stats[i].lost = pcpu_ees[i].lost;
+		qq->cpu_stats[i].sent = pcpu_ees[i].sent - pcpu_filtered[i];
+	}
 
 	return (0);
 }
@@ -318,6 +779,7 @@ static void
 bpf_queue_close(struct quark_queue *qq)
 {
 	struct bpf_queue	*bqq = qq->queue_be;
+	int			 i;
 
 	if (bqq != NULL) {
 		if (bqq->prog != NULL) {
@@ -328,10 +790,19 @@ bpf_queue_close(struct quark_queue *qq)
 			ring_buffer__free(bqq->ringbuf);
 			bqq->ringbuf = NULL;
 		}
+		/* The first one belongs to the skeleton */
+		for (i = 1; i < bqq->nrings; i++)
+			close(bqq->rings[i].fd);
+		free(bqq->rings);
+		bqq->rings = NULL;
+		bqq->nrings = 0;
 		free(bqq);
 		bqq = NULL;
 		qq->queue_be = NULL;
 	}
+	free(qq->cpu_stats);
+	qq->cpu_stats = NULL;
+	qq->num_cpus = 0;
 	/* Closed in ring_buffer__free() */
 	qq->epollfd = -1;
 }
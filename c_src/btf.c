@@ -40,6 +40,8 @@ struct quark_btf_target targets[] = {
 	{ "task_struct.comm",		-1 },
 	{ "task_struct.cred",		-1 },
 	{ "task_struct.exit_code",	-1 },
+	{ "task_struct.exit_signal",	-1 },
+	{ "task_struct.flags",		-1 },
 	{ "task_struct.fs",		-1 },
 	{ "task_struct.group_leader",	-1 },
 	{ "task_struct.mm",		-1 },
@@ -50,6 +50,10 @@ typedef uintptr_t	__uintptr_t;	/* for freebsd_tree.h */
 #define min(_a, _b)	((_a) < (_b) ? (_a) : (_b))
 #endif	/* min */
 
+#ifndef max
+#define max(_a, _b)	((_a) > (_b) ? (_a) : (_b))
+#endif	/* max */
+
 /*
  * BSD compat
  */
@@ -31,66 +31,68 @@
 #define PWD_S(_t, _o)	"task_struct.fs fs_struct.pwd.dentry " XS(RPT(_t, _o, dentry.d_parent)) " dentry.d_name.name +0"
 
 struct kprobe_arg ka_task_old_pgid = {
-	"pgid", XS(ARG_0), "u32", "task_struct.group_leader (task_struct.pids+8) (pid.numbers+0).upid.nr"
+	"pgid", XS(ARG_0), "u32", "task_struct.group_leader (task_struct.pids+8) (pid.numbers+0).upid.nr", 0
 };
 
 struct kprobe_arg ka_task_old_sid = {
-	"sid", XS(ARG_0), "u32", "task_struct.group_leader (task_struct.pids+16) (pid.numbers+0).upid.nr"
+	"sid", XS(ARG_0), "u32", "task_struct.group_leader (task_struct.pids+16) (pid.numbers+0).upid.nr", 0
 };
 
 struct kprobe_arg ka_task_new_pgid = {
-	"pgid", XS(ARG_0), "u32", "task_struct.group_leader task_struct.signal (signal_struct.pids+16) (pid.numbers+0).upid.nr"
+	"pgid", XS(ARG_0), "u32", "task_struct.group_leader task_struct.signal (signal_struct.pids+16) (pid.numbers+0).upid.nr", 0
 };
 
 struct kprobe_arg ka_task_new_sid = {
-	"sid", XS(ARG_0), "u32", "task_struct.group_leader task_struct.signal (signal_struct.pids+24) (pid.numbers+0).upid.nr"
+	"sid", XS(ARG_0), "u32", "task_struct.group_leader task_struct.signal (signal_struct.pids+24) (pid.numbers+0).upid.nr", 0
 };
 
 
 #define TASK_SAMPLE(_r)																	   \
-	{ "cap_inheritable",	XS(_r), "u64",		"task_struct.cred cred.cap_inheritable"								}, \
-	{ "cap_permitted",	XS(_r), "u64",		"task_struct.cred cred.cap_permitted",								}, \
-	{ "cap_effective",	XS(_r), "u64",		"task_struct.cred cred.cap_effective"								}, \
-	{ "cap_bset",		XS(_r), "u64",		"task_struct.cred cred.cap_bset"								}, \
-	{ "cap_ambient",	XS(_r), "u64",		"task_struct.cred cred.cap_ambient"								}, \
-	{ "start_boottime",	XS(_r), "u64",		"task_struct.start_boottime"									}, \
-	{ "tty_addr",		XS(_r), "u64",		"task_struct.signal signal_struct.tty"								}, \
-	{ "root_k",		XS(_r), "u64",		"task_struct.fs fs_struct.root.dentry"								}, \
-	{ "mnt_root_k",		XS(_r), "u64",		"task_struct.fs fs_struct.pwd.mnt vfsmount.mnt_root"						}, \
-	{ "mnt_mountpoint_k",	XS(_r), "u64",		"task_struct.fs fs_struct.pwd.mnt (mount.mnt_mountpoint-mount.mnt)"				}, \
-	{ "pwd_k0",		XS(_r), "u64",		PWD_K(0, 0)											}, \
-	{ "pwd_k1",		XS(_r), "u64",		PWD_K(0, 1)											}, \
-	{ "pwd_k2",		XS(_r), "u64",		PWD_K(0, 2)											}, \
-	{ "pwd_k3",		XS(_r), "u64",		PWD_K(0, 3)											}, \
-	{ "pwd_k4",		XS(_r), "u64",		PWD_K(0, 4)											}, \
-	{ "pwd_k5",		XS(_r), "u64",		PWD_K(0, 5)											}, \
-	{ "pwd_k6",		XS(_r), "u64",		PWD_K(0, 6)											}, \
-	{ "root_s",		XS(_r), "string",	"task_struct.fs fs_struct.root.dentry dentry.d_name.name +0"					}, \
-	{ "mnt_root_s",		XS(_r), "string",	"task_struct.fs fs_struct.pwd.mnt vfsmount.mnt_root dentry.d_name.name +0"			}, \
-	{ "mnt_mountpoint_s",	XS(_r), "string",	"task_struct.fs fs_struct.pwd.mnt (mount.mnt_mountpoint-mount.mnt) dentry.d_name.name +0"	}, \
-	{ "pwd_s0",		XS(_r), "string",	PWD_S(0, 0)											}, \
-	{ "pwd_s1",		XS(_r), "string",	PWD_S(0, 1)											}, \
-	{ "pwd_s2",		XS(_r), "string",	PWD_S(0, 2)											}, \
-	{ "pwd_s3",		XS(_r), "string",	PWD_S(0, 3)											}, \
-	{ "pwd_s4",		XS(_r), "string",	PWD_S(0, 4)											}, \
-	{ "pwd_s5",		XS(_r), "string",	PWD_S(0, 5)											}, \
-	{ "pwd_s6",		XS(_r), "string",	PWD_S(0, 6)											}, \
-	{ "comm",		XS(_r), "string",	"task_struct.comm"										}, \
-	{ "uid",		XS(_r), "u32",		"task_struct.cred cred.uid"									}, \
-	{ "gid",		XS(_r), "u32",		"task_struct.cred cred.gid"									}, \
-	{ "suid",		XS(_r), "u32",		"task_struct.cred cred.suid"									}, \
-	{ "sgid",		XS(_r), "u32",		"task_struct.cred cred.sgid"									}, \
-	{ "euid",		XS(_r), "u32",		"task_struct.cred cred.euid"									}, \
-	{ "egid",		XS(_r), "u32",		"task_struct.cred cred.egid"									}, \
-	{ "pgid",		XS(_r), "u32",		"KLUDGE - see kprobe_kludge_arg()"								}, \
-	{ "sid",		XS(_r), "u32",		"KLUDGE - see kprobe_kludge_arg()"								}, \
-	{ "pid",		XS(_r), "u32",		"task_struct.tgid"										}, \
-	{ "tid",		XS(_r), "u32",		"task_struct.pid"										}, \
-	{ "ppid",		XS(_r), "u32",		"task_struct.group_leader task_struct.real_parent task_struct.tgid"				}, \
-	{ "exit_code",		XS(_r), "s32",		"task_struct.exit_code"										}, \
-	{ "tty_major",		XS(_r), "u32",		"task_struct.signal signal_struct.tty tty_struct.driver tty_driver.major"			}, \
-	{ "tty_minor_start",	XS(_r), "u32",		"task_struct.signal signal_struct.tty tty_struct.driver tty_driver.minor_start"			}, \
-	{ "tty_minor_index",	XS(_r), "u32",		"task_struct.signal signal_struct.tty tty_struct.index"						}
+	{ "cap_inheritable",	XS(_r), "u64",		"task_struct.cred cred.cap_inheritable",								QUARK_F_CAPS	}, \
+	{ "cap_permitted",	XS(_r), "u64",		"task_struct.cred cred.cap_permitted",								QUARK_F_CAPS	}, \
+	{ "cap_effective",	XS(_r), "u64",		"task_struct.cred cred.cap_effective",								QUARK_F_CAPS	}, \
+	{ "cap_bset",		XS(_r), "u64",		"task_struct.cred cred.cap_bset",								QUARK_F_CAPS	}, \
+	{ "cap_ambient",	XS(_r), "u64",		"task_struct.cred cred.cap_ambient",								QUARK_F_CAPS	}, \
+	{ "start_boottime",	XS(_r), "u64",		"task_struct.start_boottime",									0	}, \
+	{ "tty_addr",		XS(_r), "u64",		"task_struct.signal signal_struct.tty",								0	}, \
+	{ "root_k",		XS(_r), "u64",		"task_struct.fs fs_struct.root.dentry",								QUARK_F_CWD	}, \
+	{ "mnt_root_k",		XS(_r), "u64",		"task_struct.fs fs_struct.pwd.mnt vfsmount.mnt_root",						QUARK_F_CWD	}, \
+	{ "mnt_mountpoint_k",	XS(_r), "u64",		"task_struct.fs fs_struct.pwd.mnt (mount.mnt_mountpoint-mount.mnt)",				QUARK_F_CWD	}, \
+	{ "pwd_k0",		XS(_r), "u64",		PWD_K(0, 0),											QUARK_F_CWD	}, \
+	{ "pwd_k1",		XS(_r), "u64",		PWD_K(0, 1),											QUARK_F_CWD	}, \
+	{ "pwd_k2",		XS(_r), "u64",		PWD_K(0, 2),											QUARK_F_CWD	}, \
+	{ "pwd_k3",		XS(_r), "u64",		PWD_K(0, 3),											QUARK_F_CWD	}, \
+	{ "pwd_k4",		XS(_r), "u64",		PWD_K(0, 4),											QUARK_F_CWD	}, \
+	{ "pwd_k5",		XS(_r), "u64",		PWD_K(0, 5),											QUARK_F_CWD	}, \
+	{ "pwd_k6",		XS(_r), "u64",		PWD_K(0, 6),											QUARK_F_CWD	}, \
+	{ "root_s",		XS(_r), "string",	"task_struct.fs fs_struct.root.dentry dentry.d_name.name +0",					QUARK_F_CWD	}, \
+	{ "mnt_root_s",		XS(_r), "string",	"task_struct.fs fs_struct.pwd.mnt vfsmount.mnt_root dentry.d_name.name +0",			QUARK_F_CWD	}, \
+	{ "mnt_mountpoint_s",	XS(_r), "string",	"task_struct.fs fs_struct.pwd.mnt (mount.mnt_mountpoint-mount.mnt) dentry.d_name.name +0",	QUARK_F_CWD	}, \
+	{ "pwd_s0",		XS(_r), "string",	PWD_S(0, 0),											QUARK_F_CWD	}, \
+	{ "pwd_s1",		XS(_r), "string",	PWD_S(0, 1),											QUARK_F_CWD	}, \
+	{ "pwd_s2",		XS(_r), "string",	PWD_S(0, 2),											QUARK_F_CWD	}, \
+	{ "pwd_s3",		XS(_r), "string",	PWD_S(0, 3),											QUARK_F_CWD	}, \
+	{ "pwd_s4",		XS(_r), "string",	PWD_S(0, 4),											QUARK_F_CWD	}, \
+	{ "pwd_s5",		XS(_r), "string",	PWD_S(0, 5),											QUARK_F_CWD	}, \
+	{ "pwd_s6",		XS(_r), "string",	PWD_S(0, 6),											QUARK_F_CWD	}, \
+	{ "comm",		XS(_r), "string",	"task_struct.comm",										0	}, \
+	{ "uid",		XS(_r), "u32",		"task_struct.cred cred.uid",									0	}, \
+	{ "gid",		XS(_r), "u32",		"task_struct.cred cred.gid",									0	}, \
+	{ "suid",		XS(_r), "u32",		"task_struct.cred cred.suid",									0	}, \
+	{ "sgid",		XS(_r), "u32",		"task_struct.cred cred.sgid",									0	}, \
+	{ "euid",		XS(_r), "u32",		"task_struct.cred cred.euid",									0	}, \
+	{ "egid",		XS(_r), "u32",		"task_struct.cred cred.egid",									0	}, \
+	{ "pgid",		XS(_r), "u32",		"KLUDGE - see kprobe_kludge_arg()",								0	}, \
+	{ "sid",		XS(_r), "u32",		"KLUDGE - see kprobe_kludge_arg()",								0	}, \
+	{ "pid",		XS(_r), "u32",		"task_struct.tgid",										0	}, \
+	{ "tid",		XS(_r), "u32",		"task_struct.pid",										0	}, \
+	{ "ppid",		XS(_r), "u32",		"task_struct.group_leader task_struct.real_parent task_struct.tgid",				0	}, \
+	{ "exit_code",		XS(_r), "s32",		"task_struct.exit_code",										0	}, \
+	{ "exit_signal",	XS(_r), "s32",		"task_struct.exit_signal",									0	}, \
+	{ "flags",		XS(_r), "u32",		"task_struct.flags",										0	}, \
+	{ "tty_major",		XS(_r), "u32",		"task_struct.signal signal_struct.tty tty_struct.driver tty_driver.major",			0	}, \
+	{ "tty_minor_start",	XS(_r), "u32",		"task_struct.signal signal_struct.tty tty_struct.driver tty_driver.minor_start",			0	}, \
+	{ "tty_minor_index",	XS(_r), "u32",		"task_struct.signal signal_struct.tty tty_struct.index",						0	}
 
 struct kprobe kp_wake_up_new_task = {
 	"wake_up_new_task",
@@ -98,7 +100,7 @@ struct kprobe kp_wake_up_new_task = {
 	0,
 	{
 		TASK_SAMPLE(ARG_0),
-		{ NULL, NULL, NULL, NULL },
+		{ NULL, NULL, NULL, NULL, 0 },
 	}
 };
 
@@ -108,7 +110,7 @@ struct kprobe kp_exit = {
 	0,
 	{
 		TASK_SAMPLE(ARG_0),
-		{ NULL, NULL, NULL, NULL },
+		{ NULL, NULL, NULL, NULL, 0 },
 	}
 };
 
@@ -118,68 +120,68 @@ struct kprobe kp_exec_connector = {
 	0,
 {
 	TASK_SAMPLE(ARG_0),
-	{ "argc",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +0"	},
-	{ "stack_0",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +0"	},
-	{ "stack_1",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +8"	},
-	{ "stack_2",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +16"	},
-	{ "stack_3",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +24"	},
-	{ "stack_4",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +32"	},
-	{ "stack_5",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +40"	},
-	{ "stack_6",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +48"	},
-	{ "stack_7",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +56"	},
-	{ "stack_8",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +64"	},
-	{ "stack_9",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +72"	},
-	{ "stack_10",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +80"	},
-	{ "stack_11",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +88"	},
-	{ "stack_12",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +96"	},
-	{ "stack_13",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +104"	},
-	{ "stack_14",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +112"	},
-	{ "stack_15",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +120"	},
-	{ "stack_16",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +128"	},
-	{ "stack_17",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +136"	},
-	{ "stack_18",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +144"	},
-	{ "stack_19",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +152"	},
-	{ "stack_20",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +160"	},
-	{ "stack_21",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +168"	},
-	{ "stack_22",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +176"	},
-	{ "stack_23",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +184"	},
-	{ "stack_24",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +192"	},
-	{ "stack_25",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +200"	},
-	{ "stack_26",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +208"	},
-	{ "stack_27",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +216"	},
-	{ "stack_28",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +224"	},
-	{ "stack_29",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +232"	},
-	{ "stack_30",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +240"	},
-	{ "stack_31",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +248"	},
-	{ "stack_32",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +256"	},
-	{ "stack_33",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +264"	},
-	{ "stack_34",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +272"	},
-	{ "stack_35",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +280"	},
-	{ "stack_36",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +288"	},
-	{ "stack_37",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +296"	},
-	{ "stack_38",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +304"	},
-	{ "stack_39",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +312"	},
-	{ "stack_40",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +320"	},
-	{ "stack_41",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +328"	},
-	{ "stack_42",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +336"	},
-	{ "stack_43",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +344"	},
-	{ "stack_44",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +352"	},
-	{ "stack_45",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +360"	},
-	{ "stack_46",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +368"	},
-	{ "stack_47",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +376"	},
-	{ "stack_48",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +384"	},
-	{ "stack_49",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +400"	},
-	{ "stack_50",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +408"	},
-	{ "stack_51",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +416"	},
-	{ "stack_52",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +424"	},
-	{ "stack_53",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +432"	},
-	{ "stack_54",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +440"	},
-	{ "stack_55",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +448"	},
-	{ "stack_56",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +456"	},
-	{ "stack_57",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +464"	},
-	{ "stack_58",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +472"	},
-	{ "stack_59",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +480"	},
-	{ NULL,			NULL,		NULL,	  NULL							},
+	{ "argc",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +0",	QUARK_F_CMDLINE	},
+	{ "stack_0",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +0",	QUARK_F_CMDLINE	},
+	{ "stack_1",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +8",	QUARK_F_CMDLINE	},
+	{ "stack_2",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +16",	QUARK_F_CMDLINE	},
+	{ "stack_3",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +24",	QUARK_F_CMDLINE	},
+	{ "stack_4",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +32",	QUARK_F_CMDLINE	},
+	{ "stack_5",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +40",	QUARK_F_CMDLINE	},
+	{ "stack_6",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +48",	QUARK_F_CMDLINE	},
+	{ "stack_7",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +56",	QUARK_F_CMDLINE	},
+	{ "stack_8",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +64",	QUARK_F_CMDLINE	},
+	{ "stack_9",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +72",	QUARK_F_CMDLINE	},
+	{ "stack_10",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +80",	QUARK_F_CMDLINE	},
+	{ "stack_11",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +88",	QUARK_F_CMDLINE	},
+	{ "stack_12",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +96",	QUARK_F_CMDLINE	},
+	{ "stack_13",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +104",	QUARK_F_CMDLINE	},
+	{ "stack_14",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +112",	QUARK_F_CMDLINE	},
+	{ "stack_15",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +120",	QUARK_F_CMDLINE	},
+	{ "stack_16",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +128",	QUARK_F_CMDLINE	},
+	{ "stack_17",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +136",	QUARK_F_CMDLINE	},
+	{ "stack_18",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +144",	QUARK_F_CMDLINE	},
+	{ "stack_19",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +152",	QUARK_F_CMDLINE	},
+	{ "stack_20",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +160",	QUARK_F_CMDLINE	},
+	{ "stack_21",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +168",	QUARK_F_CMDLINE	},
+	{ "stack_22",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +176",	QUARK_F_CMDLINE	},
+	{ "stack_23",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +184",	QUARK_F_CMDLINE	},
+	{ "stack_24",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +192",	QUARK_F_CMDLINE	},
+	{ "stack_25",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +200",	QUARK_F_CMDLINE	},
+	{ "stack_26",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +208",	QUARK_F_CMDLINE	},
+	{ "stack_27",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +216",	QUARK_F_CMDLINE	},
+	{ "stack_28",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +224",	QUARK_F_CMDLINE	},
+	{ "stack_29",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +232",	QUARK_F_CMDLINE	},
+	{ "stack_30",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +240",	QUARK_F_CMDLINE	},
+	{ "stack_31",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +248",	QUARK_F_CMDLINE	},
+	{ "stack_32",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +256",	QUARK_F_CMDLINE	},
+	{ "stack_33",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +264",	QUARK_F_CMDLINE	},
+	{ "stack_34",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +272",	QUARK_F_CMDLINE	},
+	{ "stack_35",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +280",	QUARK_F_CMDLINE	},
+	{ "stack_36",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +288",	QUARK_F_CMDLINE	},
+	{ "stack_37",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +296",	QUARK_F_CMDLINE	},
+	{ "stack_38",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +304",	QUARK_F_CMDLINE	},
+	{ "stack_39",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +312",	QUARK_F_CMDLINE	},
+	{ "stack_40",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +320",	QUARK_F_CMDLINE	},
+	{ "stack_41",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +328",	QUARK_F_CMDLINE	},
+	{ "stack_42",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +336",	QUARK_F_CMDLINE	},
+	{ "stack_43",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +344",	QUARK_F_CMDLINE	},
+	{ "stack_44",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +352",	QUARK_F_CMDLINE	},
+	{ "stack_45",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +360",	QUARK_F_CMDLINE	},
+	{ "stack_46",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +368",	QUARK_F_CMDLINE	},
+	{ "stack_47",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +376",	QUARK_F_CMDLINE	},
+	{ "stack_48",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +384",	QUARK_F_CMDLINE	},
+	{ "stack_49",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +400",	QUARK_F_CMDLINE	},
+	{ "stack_50",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +408",	QUARK_F_CMDLINE	},
+	{ "stack_51",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +416",	QUARK_F_CMDLINE	},
+	{ "stack_52",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +424",	QUARK_F_CMDLINE	},
+	{ "stack_53",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +432",	QUARK_F_CMDLINE	},
+	{ "stack_54",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +440",	QUARK_F_CMDLINE	},
+	{ "stack_55",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +448",	QUARK_F_CMDLINE	},
+	{ "stack_56",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +456",	QUARK_F_CMDLINE	},
+	{ "stack_57",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +464",	QUARK_F_CMDLINE	},
+	{ "stack_58",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +472",	QUARK_F_CMDLINE	},
+	{ "stack_59",		XS(ARG_0),	"u64",	  "task_struct.mm mm_struct.(anon).start_stack +8 +480",	QUARK_F_CMDLINE	},
+	{ NULL,			NULL,		NULL,	  NULL,							0		},
 }};
 
 #undef PWD_S
@@ -25,7 +25,7 @@
 
 #include "quark.h"
 
-#define PERF_MMAP_PAGES		16		/* Must be power of 2 */
+#define PERF_MMAP_MAX_PAGES	1024		/* QQ_RING_GROW stops here */
 
 struct perf_sample_id {
 	u32	pid;
@@ -119,6 +119,8 @@ struct perf_group_leader {
 	int				 cpu;
 	struct perf_event_attr		 attr;
 	struct perf_mmap		 mmap;
+	u64				 last_time;	/* of the last event read */
+	int				 grow;		/* QQ_RING_GROW, saw LOST */
 };
 
 /*
@@ -168,6 +170,8 @@ struct task_sample {
 	u32	tid;
 	u32	ppid;
 	s32	exit_code;
+	s32	exit_signal;	/* -1 for threads, see kprobe_filter_build() */
+	u32	flags;		/* PF_*, keeps us 8 byte aligned */
 	u32	tty_major;
 	u32	tty_minor_start;
 	u32	tty_minor_index;
@@ -202,6 +206,7 @@ struct kprobe_arg {
 	const char	*reg;
 	const char	*typ;
 	const char	*arg_dsl;
+	u64		 fields;	/* QUARK_F_* it feeds, 0 is always */
 };
 
 struct kprobe {
@@ -217,9 +222,11 @@ struct path_ctx {
 	char	*mnt_root;
 	u64	 mnt_root_k;
 	char	*mnt_mountpoint;
+	size_t	 mnt_mountpoint_len;
 	u64	 mnt_mountpoint_k;
 	struct {
 		char	*pwd;
+		size_t	 pwd_len;
 		u64	 pwd_k;
 	} pwd[MAX_PWD];
 };
@@ -234,6 +241,21 @@ enum sample_kinds {
 	EXEC_CONNECTOR_SAMPLE
 };
 
+/*
+ * Where each fetched arg lands in the full sample structure, args that are
+ * not in the field mask are not fetched, so the wire sample is shorter and
+ * must be unpacked, see kprobe_layout_build().
+ */
+struct sample_layout {
+	int	full;	/* wire matches the sample structure */
+	int	nruns;
+	struct {
+		u16	src;
+		u16	dst;
+		u16	len;
+	} runs[128];
+};
+
 /*
  * The actual probe definitions, they're too big and ugly so they get a separate
  * file
@@ -251,9 +273,22 @@ TAILQ_HEAD(kprobe_states, kprobe_state);
 struct kprobe_queue {
 	struct perf_group_leaders	 perf_group_leaders;
 	int				 num_perf_group_leaders;
+	/* QQ_RING_GROW: outgrown rings, disabled and read until empty */
+	struct perf_group_leaders	 retired_leaders;
+	/* QQ_BATCH_DRAIN: rings reported by epoll and when we swept them all */
+	struct epoll_event		*ready;
+	u64				 last_sweep;
+	u64				 sweep_interval;
 	struct kprobe_states		 kprobe_states;
 	ssize_t				 data_offset; /* body data off within a probe */
 	int				 qid;
+	int				 ring_wakeup;	/* in % of the ring */
+	int				 ring_max_pages;
+	/* tracefs filter of each sample kind, see kprobe_filter_build() */
+	char				*filters[EXEC_CONNECTOR_SAMPLE + 1];
+	int				 user_filters;	/* qq->nfilters > 0 */
+	u64				 field_mask;	/* qq->field_mask */
+	struct sample_layout		 layouts[EXEC_CONNECTOR_SAMPLE + 1];
 	/* matches each sample event to a kind like EXEC_SAMPLE, FOO_SAMPLE */
 	u8				 id_to_sample_kind[MAX_SAMPLE_IDS];
 };
@@ -276,6 +311,19 @@ str_of_dataloc(struct perf_record_sample *sample,
 	return (sample->data + data_loc->offset);
 }
 
+/* The size on the wire includes the NUL, unless the fetch failed */
+static size_t
+strlen_of_dataloc(struct perf_record_sample *sample,
+    struct perf_sample_data_loc *data_loc)
+{
+	char	*s = str_of_dataloc(sample, data_loc);
+
+	if (data_loc->size > 0 && s[data_loc->size - 1] == 0)
+		return (data_loc->size - 1);
+
+	return (strnlen(s, data_loc->size));
+}
+
 static inline int
 sample_kind_of_id(struct kprobe_queue *kqq, int id)
 {
@@ -300,40 +348,51 @@ sample_data_id(struct perf_record_sample *sample)
 	return (h->common_type);
 }
 
+/*
+ * Components go from the leaf up, so first find out how long the path is, then
+ * write them backwards straight into dst.
+ */
 static int
 build_path(struct path_ctx *ctx, struct qstr *dst)
 {
-	int	 i, done;
-	char	*p, *pwd, *ppwd, path[MAXPATHLEN];
+	int	 i, n, done;
+	char	*p, *pwd[MAX_PWD];
+	size_t	 len, pwd_len[MAX_PWD];
 	u64	 pwd_k;
 
-	p = &path[sizeof(path) - 1];
-	*p = 0;
+	len = 0;
 	done = 0;
-	for (i = 0; i < (int)nitems(ctx->pwd) && !done; i++) {
-		pwd_k = ctx->pwd[i].pwd_k;
-		pwd = ctx->pwd[i].pwd;
+	for (n = 0; n < (int)nitems(ctx->pwd) && !done; n++) {
+		pwd_k = ctx->pwd[n].pwd_k;
+		pwd[n] = ctx->pwd[n].pwd;
+		pwd_len[n] = ctx->pwd[n].pwd_len;
 		if (pwd_k == ctx->root_k)
 			break;
 		if (pwd_k == ctx->mnt_root_k) {
-			pwd = ctx->mnt_mountpoint;
+			pwd[n] = ctx->mnt_mountpoint;
+			pwd_len[n] = ctx->mnt_mountpoint_len;
 			done = 1;
 		}
-		/* XXX this strlen sucks as we had the length on the wire */
-		ppwd = pwd + strlen(pwd);
 		/* +1 is the / */
-		/* XXX this is way too dangerous XXX */
-		if (((ppwd - pwd) + 1) > (p - path))
-			return (errno = ENAMETOOLONG, -1);
-		while (ppwd != pwd)
-			*--p = *--ppwd;
-		*--p = '/';
+		len += pwd_len[n] + 1;
+	}
+	if (len == 0) {
+		pwd_len[0] = 0;
+		len = n = 1;
 	}
-	if (*p == 0)
+	if (len >= MAXPATHLEN)
+		return (errno = ENAMETOOLONG, -1);
+	if (qstr_ensure(dst, len + 1) == -1)
+		return (-1);
+	p = dst->p + len;
+	*p = 0;
+	for (i = 0; i < n; i++) {
+		p -= pwd_len[i];
+		memcpy(p, pwd[i], pwd_len[i]);
 		*--p = '/';
+	}
 
-	/* XXX double copy XXX */
-	return (qstr_strcpy(dst, p));
+	return (0);
 }
 
 static int
@@ -348,11 +407,33 @@ qstr_copy_data_loc(struct qstr *qstr,
 	return (data_loc->size);
 }
 
+/*
+ * Returns the body of sample as the full structure, if some args were not
+ * fetched it gets unpacked into scratch with the missing fields zeroed.
+ */
+static void *
+sample_data_unpack(struct kprobe_queue *kqq, int kind,
+    struct perf_record_sample *sample, void *scratch, size_t scratch_len)
+{
+	struct sample_layout	*sl = &kqq->layouts[kind];
+	u8			*body = sample_data_body(kqq, sample);
+	int			 i;
+
+	if (sl->full)
+		return (body);
+	bzero(scratch, scratch_len);
+	for (i = 0; i < sl->nruns; i++)
+		memcpy((u8 *)scratch + sl->runs[i].dst, body + sl->runs[i].src,
+		    sl->runs[i].len);
+
+	return (scratch);
+}
+
 static void
 task_sample_to_raw_task(struct kprobe_queue *kqq, int kind,
-    struct perf_record_sample *sample, struct raw_task *task)
+    struct perf_record_sample *sample, struct task_sample *w,
+    struct raw_task *task)
 {
-	struct task_sample	*w = sample_data_body(kqq, sample);
 	struct path_ctx		 pctx;
 	int			 i;
 
@@ -389,6 +470,10 @@ task_sample_to_raw_task(struct kprobe_queue *kqq, int kind,
 	task->exit_code = -1;
 	task->exit_time_event = 0;
 
+	if ((kqq->field_mask & QUARK_F_CWD) == 0) {
+		task->cwd.p[0] = 0;
+		return;
+	}
 	/* Consider moving all this inside build_path() */
 	pctx.root = str_of_dataloc(sample, &w->root_s);
 	pctx.root_k = w->root_k;
@@ -396,10 +481,14 @@ task_sample_to_raw_task(struct kprobe_queue *kqq, int kind,
 	pctx.mnt_root_k = w->mnt_root_k;
 	pctx.mnt_mountpoint = str_of_dataloc(sample,
 	    &w->mnt_mountpoint_s);
+	pctx.mnt_mountpoint_len = strlen_of_dataloc(sample,
+	    &w->mnt_mountpoint_s);
 	pctx.mnt_mountpoint_k = w->mnt_mountpoint_k;
 	for (i = 0; i < (int)nitems(pctx.pwd); i++) {
 		pctx.pwd[i].pwd = str_of_dataloc(sample,
 		    &w->pwd_s[i]);
+		pctx.pwd[i].pwd_len = strlen_of_dataloc(sample,
+		    &w->pwd_s[i]);
 		pctx.pwd[i].pwd_k = w->pwd_k[i];
 	}
 	if (build_path(&pctx, &task->cwd) == -1)
@@ -413,6 +502,10 @@ perf_sample_to_raw(struct quark_queue *qq, struct perf_record_sample *sample)
 	int			 id, kind;
 	ssize_t			 n;
 	struct raw_event	*raw = NULL;
+	union {
+		struct task_sample		task;
+		struct exec_connector_sample	exec_connector;
+	} scratch;
 
 	id = sample_data_id(sample);
 	kind = sample_kind_of_id(kqq, id);
@@ -420,7 +513,7 @@ perf_sample_to_raw(struct quark_queue *qq, struct perf_record_sample *sample)
 	switch (kind) {
 	case EXEC_SAMPLE: {
 		struct exec_sample *exec = sample_data_body(kqq, sample);
-		if ((raw = raw_event_alloc(RAW_EXEC)) == NULL)
+		if ((raw = raw_event_alloc(qq, RAW_EXEC)) == NULL)
 			return (NULL);
 		n = qstr_copy_data_loc(&raw->exec.filename, sample, &exec->filename);
 		if (n == -1)
@@ -429,18 +522,22 @@ perf_sample_to_raw(struct quark_queue *qq, struct perf_record_sample *sample)
 	}
 	case WAKE_UP_NEW_TASK_SAMPLE: /* FALLTHROUGH */
 	case EXIT_THREAD_SAMPLE: {
-		struct task_sample	*w = sample_data_body(kqq, sample);
+		struct task_sample	*w;
 		int			 raw_type;
+
+		w = sample_data_unpack(kqq, kind, sample, &scratch.task,
+		    sizeof(scratch.task));
 		/*
 		 * ev->sample.sample_id.pid is the parent, if the new task has
-		 * the same pid as it, then this is a thread event
+		 * the same pid as it, then this is a thread event. Normally
+		 * the kernel drops these, see kprobe_filter_build().
 		 */
 		if ((qq->flags & QQ_THREAD_EVENTS) == 0
 		    && w->pid != w->tid)
 			return (NULL);
 		raw_type = kind == WAKE_UP_NEW_TASK_SAMPLE ?
 		    RAW_WAKE_UP_NEW_TASK : RAW_EXIT_THREAD;
-		if ((raw = raw_event_alloc(raw_type)) == NULL)
+		if ((raw = raw_event_alloc(qq, raw_type)) == NULL)
 			return (NULL);
 		/*
 		 * Cheat, make it look like a child event
@@ -449,16 +546,18 @@ perf_sample_to_raw(struct quark_queue *qq, struct perf_record_sample *sample)
 			raw->pid = w->pid;
 			raw->tid = w->tid;
 		}
-		task_sample_to_raw_task(kqq, kind, sample, &raw->task);
+		task_sample_to_raw_task(kqq, kind, sample, w, &raw->task);
 		break;
 	}
 	case EXEC_CONNECTOR_SAMPLE: {
 		char				*start, *p, *end;
 		int				 i;
-		struct exec_connector_sample	*exec_sample = sample_data_body(kqq, sample);
+		struct exec_connector_sample	*exec_sample;
 		struct raw_exec_connector	*exec;
 
-		if ((raw = raw_event_alloc(RAW_EXEC_CONNECTOR)) == NULL)
+		exec_sample = sample_data_unpack(kqq, kind, sample, &scratch,
+		    sizeof(scratch));
+		if ((raw = raw_event_alloc(qq, RAW_EXEC_CONNECTOR)) == NULL)
 			return (NULL);
 		exec = &raw->exec_connector;
 
@@ -477,7 +576,8 @@ perf_sample_to_raw(struct quark_queue *qq, struct perf_record_sample *sample)
 				warnx("can't copy args");
 			exec->args.p[exec->args_len - 1] = 0;
 		}
-		task_sample_to_raw_task(kqq, kind, sample, &exec->task);
+		task_sample_to_raw_task(kqq, kind, sample,
+		    &exec_sample->task_sample, &exec->task);
 		break;
 	}
 	default:
@@ -511,7 +611,7 @@ perf_event_to_raw(struct quark_queue *qq, struct perf_event *ev)
 		if ((qq->flags & QQ_THREAD_EVENTS) == 0 &&
 		    ev->comm.pid != ev->comm.tid)
 			return (NULL);
-		if ((raw = raw_event_alloc(RAW_COMM)) == NULL)
+		if ((raw = raw_event_alloc(qq, RAW_COMM)) == NULL)
 			return (NULL);
 		n = strlcpy(raw->comm.comm, ev->comm.comm,
 		    sizeof(raw->comm.comm));
@@ -548,7 +648,6 @@ perf_event_to_raw(struct quark_queue *qq, struct perf_event *ev)
 		if (raw->tid == 0)
 			raw->tid = sid->tid;
 		raw->opid = sid->pid;
-		raw->tid = sid->tid;
 		raw->time = sid->time;
 		raw->cpu = sid->cpu;
 	}
@@ -557,14 +656,14 @@ perf_event_to_raw(struct quark_queue *qq, struct perf_event *ev)
 }
 
 static int
-perf_mmap_init(struct perf_mmap *mm, int fd)
+perf_mmap_init(struct perf_mmap *mm, int fd, int pages)
 {
-	mm->mapped_size = (1 + PERF_MMAP_PAGES) * getpagesize();
+	mm->mapped_size = (1 + pages) * getpagesize();
 	mm->metadata = mmap(NULL, mm->mapped_size, PROT_READ|PROT_WRITE,
 	    MAP_SHARED, fd, 0);
 	if (mm->metadata == MAP_FAILED)
 		return (-1);
-	mm->data_size = PERF_MMAP_PAGES * getpagesize();
+	mm->data_size = pages * getpagesize();
 	mm->data_mask = mm->data_size - 1;
 	mm->data_start = (uint8_t *)mm->metadata + getpagesize();
 	mm->data_tmp_tail = mm->metadata->data_tail;
@@ -584,15 +683,24 @@ perf_mmap_update_tail(struct perf_event_mmap_page *metadata, uint64_t tail)
 	return (__atomic_store_n(&metadata->data_tail, tail, __ATOMIC_RELEASE));
 }
 
+static inline int
+perf_mmap_empty(struct perf_mmap *mm)
+{
+	return ((perf_mmap_load_head(mm->metadata) - mm->data_tmp_tail) <
+	    sizeof(struct perf_event_header));
+}
+
+/*
+ * Read the next event up to data_head, the tail is only published to the kernel
+ * by perf_mmap_consume(), so callers may read many events and consume once.
+ */
 static struct perf_event *
-perf_mmap_read(struct perf_mmap *mm)
+perf_mmap_read(struct perf_mmap *mm, uint64_t data_head)
 {
 	struct perf_event_header	*evh;
-	uint64_t			 data_head;
 	int				 diff;
 	ssize_t				 leftcont;	/* contiguous size left */
 
-	data_head = perf_mmap_load_head(mm->metadata);
 	diff = data_head - mm->data_tmp_tail;
 	evh = (struct perf_event_header *)
 	    (mm->data_start + (mm->data_tmp_tail & mm->data_mask));
@@ -927,8 +1035,67 @@ kprobe_tracefs_name(struct kprobe *k, u64 qid, char *buf, size_t len)
 	snprintf(buf, len, "quark_%s_%llu_%llu", k->target, (u64)getpid(), qid);
 }
 
+static int
+kprobe_arg_wanted(struct kprobe_arg *karg, u64 fields)
+{
+	return (karg->fields == 0 || (karg->fields & fields));
+}
+
+static int
+kprobe_arg_size(struct kprobe_arg *karg)
+{
+	if (!strcmp(karg->typ, "u64") || !strcmp(karg->typ, "s64"))
+		return (8);
+	/* u32, s32 and string, which is a perf_sample_data_loc */
+	return (4);
+}
+
+/*
+ * Walk the args like kprobe_build_string() does, tracefs packs the fetched
+ * ones back to back, so that's where they are on the wire.
+ */
+static int
+kprobe_layout_build(struct kprobe *k, u64 fields, struct sample_layout *sl)
+{
+	struct kprobe_arg	*karg;
+	int			 src, dst, len;
+
+	bzero(sl, sizeof(*sl));
+	sl->full = 1;
+	/* probe_ip, always there */
+	src = dst = sizeof(u64);
+	sl->runs[0].len = sizeof(u64);
+	sl->nruns = 1;
+	for (karg = k->args; karg->name != NULL; karg++) {
+		len = kprobe_arg_size(karg);
+		if (!kprobe_arg_wanted(karg, fields)) {
+			sl->full = 0;
+			dst += len;
+			continue;
+		}
+		/* Extend the last run if contiguous */
+		if (sl->runs[sl->nruns - 1].src + sl->runs[sl->nruns - 1].len ==
+		    src && sl->runs[sl->nruns - 1].dst +
+		    sl->runs[sl->nruns - 1].len == dst)
+			sl->runs[sl->nruns - 1].len += len;
+		else {
+			if (sl->nruns == (int)nitems(sl->runs))
+				return (errno = E2BIG, -1);
+			sl->runs[sl->nruns].src = src;
+			sl->runs[sl->nruns].dst = dst;
+			sl->runs[sl->nruns].len = len;
+			sl->nruns++;
+		}
+		src += len;
+		dst += len;
+	}
+
+	return (0);
+}
+
 static char *
-kprobe_build_string(struct kprobe *k, char *name, struct quark_btf *qbtf)
+kprobe_build_string(struct kprobe *k, char *name, struct quark_btf *qbtf,
+    u64 fields)
 {
 	struct kprobe_arg	*karg;
 	char			*p, *o, *a;
@@ -939,6 +1106,8 @@ kprobe_build_string(struct kprobe *k, char *name, struct quark_btf *qbtf)
 	if (r == -1)
 		return (NULL);
 	for (karg = k->args; karg->name != NULL; karg++) {
+		if (!kprobe_arg_wanted(karg, fields))
+			continue;
 		a = kprobe_make_arg(k, karg, qbtf);
 		if (a == NULL) {
 			free(p);
@@ -986,7 +1155,7 @@ kprobe_uninstall(struct kprobe *k, u64 qid)
  * easier.
  */
 static int
-kprobe_install(struct kprobe *k, u64 qid, struct quark_btf *qbtf)
+kprobe_install(struct kprobe *k, u64 qid, struct quark_btf *qbtf, u64 fields)
 {
 	int	 fd;
 	ssize_t	 n;
@@ -997,7 +1166,7 @@ kprobe_install(struct kprobe *k, u64 qid, struct quark_btf *qbtf)
 
 	if (kprobe_uninstall(k, qid) == -1 && errno != ENOENT)
 		warn("kprobe_uninstall");
-	if ((kstr = kprobe_build_string(k, fsname, qbtf)) == NULL)
+	if ((kstr = kprobe_build_string(k, fsname, qbtf, fields)) == NULL)
 		return (-1);
 	if ((fd = open_tracing(O_WRONLY, "kprobe_events")) == -1) {
 		free(kstr);
@@ -1013,7 +1182,7 @@ kprobe_install(struct kprobe *k, u64 qid, struct quark_btf *qbtf)
 }
 
 static int
-kprobe_install_all(u64 qid)
+kprobe_install_all(u64 qid, u64 fields)
 {
 	int			 i, r;
 	struct quark_btf	*qbtf;
@@ -1025,7 +1194,7 @@ kprobe_install_all(u64 qid)
 
 	r = 0;
 	for (i = 0; all_kprobes[i] != NULL; i++) {
-		if (kprobe_install(all_kprobes[i], qid, qbtf) == -1) {
+		if (kprobe_install(all_kprobes[i], qid, qbtf, fields) == -1) {
 			warnx("%s: kprobe %s failed", __func__,
 			    all_kprobes[i]->target);
 			/* Uninstall the ones that succeeded */
@@ -1074,8 +1243,101 @@ perf_attr_init(struct perf_event_attr *attr, int id)
 	attr->disabled = 1;
 }
 
+/*
+ * Build the tracefs filter for the probe of a sample kind, it says which events
+ * to keep. Threads have an exit_signal of -1, so unless QQ_THREAD_EVENTS, task
+ * samples are only kept for processes. The sched_process_exec tracepoint has
+ * only pid and the generic comm, uid filters can't be applied to it.
+ */
+static int
+kprobe_filter_build(struct quark_queue *qq, int kind, char **filter)
+{
+	struct quark_filter	*f;
+	char			*s, *o, *p;
+	int			 i, r, len;
+
+	*filter = s = NULL;
+	if ((qq->flags & QQ_THREAD_EVENTS) == 0 &&
+	    (kind == WAKE_UP_NEW_TASK_SAMPLE || kind == EXIT_THREAD_SAMPLE)) {
+		if ((s = strdup("exit_signal >= 0")) == NULL)
+			return (-1);
+	}
+	for (i = 0; i < qq->nfilters; i++) {
+		f = &qq->filters[i];
+		switch (f->type) {
+		case QUARK_FILTER_PID:
+			r = asprintf(&p, "%s != %u",
+			    kind == EXEC_SAMPLE ? "pid" : "tid", f->id);
+			break;
+		case QUARK_FILTER_TGID:
+			r = asprintf(&p, "pid != %u", f->id);
+			break;
+		case QUARK_FILTER_UID:
+			if (kind == EXEC_SAMPLE)
+				continue;
+			r = asprintf(&p, "uid != %u", f->id);
+			break;
+		case QUARK_FILTER_COMM:
+			len = strnlen(f->comm, sizeof(f->comm));
+			/* No escaping in tracefs globs */
+			if (memchr(f->comm, '"', len) != NULL ||
+			    memchr(f->comm, '\\', len) != NULL ||
+			    memchr(f->comm, '*', len) != NULL ||
+			    memchr(f->comm, '?', len) != NULL ||
+			    memchr(f->comm, '[', len) != NULL) {
+				free(s);
+				return (errno = EINVAL, -1);
+			}
+			r = asprintf(&p, "!(comm ~ \"%.*s*\")", len, f->comm);
+			break;
+		default:
+			free(s);
+			return (errno = ENOTSUP, -1);
+		}
+		if (r == -1) {
+			free(s);
+			return (-1);
+		}
+		if (s == NULL) {
+			s = p;
+			continue;
+		}
+		o = s;
+		r = asprintf(&s, "%s && %s", o, p);
+		free(o);
+		free(p);
+		if (r == -1)
+			return (-1);
+	}
+	*filter = s;
+
+	return (0);
+}
+
+/*
+ * A filter that only drops thread events is an optimization, if the kernel
+ * can't take it we carry on and perf_sample_to_raw() drops them, user filters
+ * can't be done in userland.
+ */
+static int
+perf_set_filter(struct kprobe_queue *kqq, int fd, int kind)
+{
+	char	**filter = &kqq->filters[kind];
+
+	if (*filter == NULL ||
+	    ioctl(fd, PERF_EVENT_IOC_SET_FILTER, *filter) == 0)
+		return (0);
+	warn("ioctl PERF_EVENT_IOC_SET_FILTER \"%s\"", *filter);
+	if (kqq->user_filters)
+		return (-1);
+	free(*filter);
+	*filter = NULL;
+
+	return (0);
+}
+
 static struct perf_group_leader *
-perf_open_group_leader(struct kprobe_queue *kqq, int cpu)
+perf_open_group_leader(struct kprobe_queue *kqq, int cpu, int pages)
 {
 	struct perf_group_leader	*pgl;
 	int				 id;
@@ -1098,14 +1360,20 @@ perf_open_group_leader(struct kprobe_queue *kqq, int cpu)
 	pgl->attr.comm_exec = 1;
 	pgl->attr.sample_id_all = 1;		/* add sample_id to all types */
 	pgl->attr.watermark = 1;
-	pgl->attr.wakeup_watermark = (PERF_MMAP_PAGES * getpagesize()) / 10;;
+	pgl->attr.wakeup_watermark = max(1,
+	    ((u64)pages * getpagesize() * kqq->ring_wakeup) / 100);
 
 	pgl->fd = perf_event_open(&pgl->attr, -1, cpu, -1, 0);
 	if (pgl->fd == -1) {
 		free(pgl);
 		return (NULL);
 	}
-	if (perf_mmap_init(&pgl->mmap, pgl->fd) == -1) {
+	if (perf_set_filter(kqq, pgl->fd, EXEC_SAMPLE) == -1) {
+		close(pgl->fd);
+		free(pgl);
+		return (NULL);
+	}
+	if (perf_mmap_init(&pgl->mmap, pgl->fd, pages) == -1) {
 		close(pgl->fd);
 		free(pgl);
 		return (NULL);
@@ -1116,6 +1384,24 @@ perf_open_group_leader(struct kprobe_queue *kqq, int cpu)
 	return (pgl);
 }
 
+static void
+perf_close_group_leader(struct perf_group_leader *pgl)
+{
+	/* XXX PERF_IOC_FLAG_GROUP see bugs */
+	if (pgl->fd != -1) {
+		if (ioctl(pgl->fd, PERF_EVENT_IOC_DISABLE,
+		    PERF_IOC_FLAG_GROUP) == -1)
+			warnx("ioctl PERF_EVENT_IOC_DISABLE:");
+		close(pgl->fd);
+	}
+	if (pgl->mmap.metadata != NULL) {
+		if (munmap(pgl->mmap.metadata,
+		    pgl->mmap.mapped_size) != 0)
+			warn("munmap");
+	}
+	free(pgl);
+}
+
 static struct kprobe_state *
 perf_open_kprobe(struct kprobe_queue *kqq, struct kprobe *k,
     u64 qid, int cpu, int group_fd)
@@ -1145,6 +1431,11 @@ perf_open_kprobe(struct kprobe_queue *kqq, struct kprobe *k,
 		free(ks);
 		return (NULL);
 	}
+	if (perf_set_filter(kqq, ks->fd, k->sample_kind) == -1) {
+		close(ks->fd);
+		free(ks);
+		return (NULL);
+	}
 	/* Output our records in the group_fd */
 	if (ioctl(ks->fd, PERF_EVENT_IOC_SET_OUTPUT, group_fd) == -1) {
 		close(ks->fd);
@@ -1178,24 +1469,50 @@ kprobe_queue_open(struct quark_queue *qq)
 	qid = __atomic_fetch_add(&qids, 1, __ATOMIC_RELAXED);
 	if ((data_offset = parse_data_offset()) == -1)
 		goto fail;
-	if (kprobe_install_all(qid) == -1)
+	if (kprobe_install_all(qid, qq->field_mask) == -1)
 		goto fail;
 	if ((kqq = calloc(1, sizeof(*kqq))) == NULL)
 		goto fail;
 
 	TAILQ_INIT(&kqq->perf_group_leaders);
 	kqq->num_perf_group_leaders = 0;
+	TAILQ_INIT(&kqq->retired_leaders);
 	TAILQ_INIT(&kqq->kprobe_states);
 	kqq->qid = qid;
 	kqq->data_offset = data_offset;
+	kqq->ring_wakeup = qq->ring_wakeup;
+	kqq->ring_max_pages = max(qq->ring_pages, PERF_MMAP_MAX_PAGES);
+	kqq->user_filters = qq->nfilters > 0;
+	kqq->field_mask = qq->field_mask;
 	qq->queue_be = kqq;
 
-	for (i = 0; i < get_nprocs_conf(); i++) {
-		pgl = perf_open_group_leader(kqq, i);
+	for (i = 0; (k = all_kprobes[i]) != NULL; i++) {
+		if (kprobe_layout_build(k, kqq->field_mask,
+		    &kqq->layouts[k->sample_kind]) == -1) {
+			warn("%s: can't build sample layout", __func__);
+			goto fail;
+		}
+	}
+
+	for (i = EXEC_SAMPLE; i < (int)nitems(kqq->filters); i++) {
+		if (kprobe_filter_build(qq, i, &kqq->filters[i]) == -1) {
+			warn("%s: can't build filter", __func__);
+			goto fail;
+		}
+	}
+
+	qq->num_cpus = get_nprocs_conf();
+	qq->cpu_stats = calloc(qq->num_cpus, sizeof(*qq->cpu_stats));
+	if (qq->cpu_stats == NULL)
+		goto fail;
+
+	for (i = 0; i < qq->num_cpus; i++) {
+		pgl = perf_open_group_leader(kqq, i, qq->ring_pages);
 		if (pgl == NULL)
 			goto fail;
 		TAILQ_INSERT_TAIL(&kqq->perf_group_leaders, pgl, entry);
 		kqq->num_perf_group_leaders++;
+		qq->cpu_stats[i].size = pgl->mmap.data_size;
 	}
 
 	i = 0;
@@ -1230,13 +1547,31 @@ kprobe_queue_open(struct quark_queue *qq)
 	TAILQ_FOREACH(pgl, &kqq->perf_group_leaders, entry) {
 		bzero(&ev, sizeof(ev));
 		ev.events = EPOLLIN;
-		ev.data.fd = pgl->fd;
+		ev.data.ptr = pgl;
 		if (epoll_ctl(qq->epollfd, EPOLL_CTL_ADD, pgl->fd, &ev) == -1) {
 			warn("epoll_ctl");
 			goto fail;
 		}
 	}
 
+	/*
+	 * A ring below its wakeup watermark is never reported by epoll, look at
+	 * all of them often enough that events still have time to be ordered
+	 * and aggregated.
+	 */
+	kqq->sweep_interval = MS_TO_NS(qq->hold_time) / 10;
+	if (qq->flags & QQ_WATERMARK)
+		kqq->sweep_interval = min(kqq->sweep_interval, qq->agg_window);
+	qq->ring_tick = max(kqq->sweep_interval, MS_TO_NS(1));
+
+	if (qq->flags & QQ_BATCH_DRAIN) {
+		/* +1 for the timer of quark_queue_block() */
+		kqq->ready = calloc(kqq->num_perf_group_leaders + 1,
+		    sizeof(*kqq->ready));
+		if (kqq->ready == NULL)
+			goto fail;
+	}
+
 	qq->queue_ops = &queue_ops_kprobe;
 
 	return (0);
@@ -1247,17 +1582,270 @@ fail:
 	return (-1);
 }
 
+/*
+ * The watermark of a ring is the time of the last event we read from it, or the
+ * time we started populating if we drained it, see raw_event_watermarked().
+ */
+static void
+kprobe_queue_watermark(struct quark_queue *qq, u64 start)
+{
+	struct kprobe_queue		*kqq = qq->queue_be;
+	struct perf_group_leader	*pgl;
+	u64				 wm;
+
+	wm = (u64)-1;
+	TAILQ_FOREACH(pgl, &kqq->perf_group_leaders, entry) {
+		if (perf_mmap_empty(&pgl->mmap))
+			wm = min(wm, start);
+		else
+			wm = min(wm, pgl->last_time);
+	}
+	/* Whatever is left in them is older than what's in the new rings */
+	TAILQ_FOREACH(pgl, &kqq->retired_leaders, entry)
+		wm = min(wm, pgl->last_time);
+	qq->watermark = wm == (u64)-1 ? 0 : wm;
+}
+
+static inline void
+kprobe_cpu_stats(struct quark_queue *qq, struct perf_group_leader *pgl,
+    struct perf_event *ev)
+{
+	struct quark_cpu_stats	*cs = &qq->cpu_stats[pgl->cpu];
+
+	cs->bytes += ev->header.size;
+	if (ev->header.type == PERF_RECORD_LOST) {
+		cs->lost += ev->lost.lost;
+		pgl->grow = (qq->flags & QQ_RING_GROW) != 0;
+	} else
+		cs->sent++;
+}
+
+/*
+ * Read everything up to the head we load once, and publish the tail once.
+ */
+static int
+kprobe_queue_drain(struct quark_queue *qq, struct perf_group_leader *pgl)
+{
+	struct perf_event	*ev;
+	struct raw_event	*raw;
+	u64			 data_head;
+	int			 npop;
+
+	npop = 0;
+	data_head = perf_mmap_load_head(pgl->mmap.metadata);
+	qq->cpu_stats[pgl->cpu].fill = data_head - pgl->mmap.data_tmp_tail;
+	while (qq->length < qq->max_length &&
+	    (ev = perf_mmap_read(&pgl->mmap, data_head)) != NULL) {
+		kprobe_cpu_stats(qq, pgl, ev);
+		raw = perf_event_to_raw(qq, ev);
+		if (raw != NULL) {
+			pgl->last_time = raw->time;
+			raw_event_insert(qq, raw);
+			npop++;
+		}
+	}
+	perf_mmap_consume(&pgl->mmap);
+
+	return (npop);
+}
+
+/*
+ * QQ_BATCH_DRAIN, only look at the rings epoll reports as ready, unless it's
+ * time to sweep them all.
+ */
+static int
+kprobe_queue_populate_batch(struct quark_queue *qq, u64 now)
+{
+	struct kprobe_queue		*kqq = qq->queue_be;
+	struct perf_group_leader	*pgl;
+	int				 i, n, npop;
+
+	npop = 0;
+	if (now - kqq->last_sweep >= kqq->sweep_interval) {
+		kqq->last_sweep = now;
+		TAILQ_FOREACH(pgl, &kqq->perf_group_leaders, entry)
+			npop += kprobe_queue_drain(qq, pgl);
+
+		return (npop);
+	}
+
+	n = epoll_wait(qq->epollfd, kqq->ready,
+	    kqq->num_perf_group_leaders + 1, 0);
+	if (n == -1)
+		return (errno == EINTR ? 0 : -1);
+	for (i = 0; i < n; i++) {
+		/* The timer, see quark_queue_timer_open() */
+		if (kqq->ready[i].data.ptr == qq)
+			continue;
+		npop += kprobe_queue_drain(qq, kqq->ready[i].data.ptr);
+	}
+
+	return (npop);
+}
+
+/*
+ * QQ_RING_GROW, replace the ring of a cpu that lost events with one twice as
+ * big, the process cache and the other rings are left alone. The new group is
+ * opened and enabled right after the old one is disabled, so only what fires
+ * in between is lost, what was left in the old ring is read before closing it.
+ */
+static int
+kprobe_queue_grow(struct quark_queue *qq, struct perf_group_leader *old)
+{
+	struct kprobe_queue		*kqq = qq->queue_be;
+	struct perf_group_leader	*pgl;
+	struct kprobe_states		 kstates;
+	struct kprobe_state		*ks, *ks_next;
+	struct kprobe			*k;
+	struct epoll_event		 ev;
+	int				 i, pages;
+
+	old->grow = 0;
+	pages = (old->mmap.data_size / getpagesize()) * 2;
+	if (pages > kqq->ring_max_pages)
+		return (0);
+
+	TAILQ_INIT(&kstates);
+	if ((pgl = perf_open_group_leader(kqq, old->cpu, pages)) == NULL)
+		goto fail;
+	i = 0;
+	while ((k = all_kprobes[i++]) != NULL) {
+		ks = perf_open_kprobe(kqq, k, kqq->qid, pgl->cpu, pgl->fd);
+		if (ks == NULL)
+			goto fail;
+		TAILQ_INSERT_TAIL(&kstates, ks, entry);
+	}
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = pgl;
+	if (epoll_ctl(qq->epollfd, EPOLL_CTL_ADD, pgl->fd, &ev) == -1)
+		goto fail;
+
+	/* XXX PERF_IOC_FLAG_GROUP see bugs */
+	if (ioctl(old->fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP) == -1)
+		warn("ioctl PERF_EVENT_IOC_DISABLE");
+	if (ioctl(pgl->fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) == -1 ||
+	    ioctl(pgl->fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+		warn("ioctl PERF_EVENT_IOC_ENABLE");
+		if (ioctl(old->fd, PERF_EVENT_IOC_ENABLE,
+		    PERF_IOC_FLAG_GROUP) == -1)
+			warn("ioctl PERF_EVENT_IOC_ENABLE");
+		(void)epoll_ctl(qq->epollfd, EPOLL_CTL_DEL, pgl->fd, NULL);
+		goto fail;
+	}
+	(void)kprobe_queue_drain(qq, old);
+	pgl->last_time = old->last_time;
+
+	TAILQ_FOREACH_SAFE(ks, &kqq->kprobe_states, entry, ks_next) {
+		if (ks->group_fd != old->fd)
+			continue;
+		TAILQ_REMOVE(&kqq->kprobe_states, ks, entry);
+		close(ks->fd);
+		free(ks);
+	}
+	TAILQ_CONCAT(&kqq->kprobe_states, &kstates, entry);
+	TAILQ_INSERT_AFTER(&kqq->perf_group_leaders, old, pgl, entry);
+	TAILQ_REMOVE(&kqq->perf_group_leaders, old, entry);
+	(void)epoll_ctl(qq->epollfd, EPOLL_CTL_DEL, old->fd, NULL);
+	/*
+	 * We grow under pressure, the drain above likely stopped at a full
+	 * queue, keep the old ring around until we read it all.
+	 */
+	if (perf_mmap_empty(&old->mmap))
+		perf_close_group_leader(old);
+	else
+		TAILQ_INSERT_TAIL(&kqq->retired_leaders, old, entry);
+	qq->cpu_stats[pgl->cpu].size = pgl->mmap.data_size;
+
+	return (0);
+
+fail:
+	warn("%s: can't grow ring of cpu %d to %d pages", __func__,
+	    old->cpu, pages);
+	/* Don't try this size again on any cpu */
+	kqq->ring_max_pages = pages / 2;
+	while ((ks = TAILQ_FIRST(&kstates)) != NULL) {
+		TAILQ_REMOVE(&kstates, ks, entry);
+		close(ks->fd);
+		free(ks);
+	}
+	if (pgl != NULL)
+		perf_close_group_leader(pgl);
+
+	return (-1);
+}
+
+static void
+kprobe_queue_grow_all(struct quark_queue *qq)
+{
+	struct kprobe_queue		*kqq = qq->queue_be;
+	struct perf_group_leader	*pgl, *pgl_next;
+
+	TAILQ_FOREACH_SAFE(pgl, &kqq->perf_group_leaders, entry, pgl_next) {
+		if (pgl->grow)
+			(void)kprobe_queue_grow(qq, pgl);
+	}
+}
+
+/*
+ * QQ_RING_GROW, read what's left in the rings we outgrew, before the new ones
+ * as their events are older.
+ */
+static int
+kprobe_queue_drain_retired(struct quark_queue *qq)
+{
+	struct kprobe_queue		*kqq = qq->queue_be;
+	struct perf_group_leader	*pgl, *pgl_next;
+	int				 npop;
+
+	npop = 0;
+	TAILQ_FOREACH_SAFE(pgl, &kqq->retired_leaders, entry, pgl_next) {
+		npop += kprobe_queue_drain(qq, pgl);
+		if (!perf_mmap_empty(&pgl->mmap))
+			continue;
+		TAILQ_REMOVE(&kqq->retired_leaders, pgl, entry);
+		perf_close_group_leader(pgl);
+	}
+
+	return (npop);
+}
+
 static int
 kprobe_queue_populate(struct quark_queue *qq)
 {
 	struct kprobe_queue		*kqq = qq->queue_be;
-	int				 empty_rings, num_rings, npop;
+	int				 empty_rings, num_rings, npop, n;
 	struct perf_group_leader	*pgl;
 	struct perf_event		*ev;
 	struct raw_event		*raw;
+	u64				 start;
 
 	num_rings = kqq->num_perf_group_leaders;
 	npop = 0;
+	start = (qq->flags & QQ_WATERMARK) ? now64() : 0;
+
+	if (!TAILQ_EMPTY(&kqq->retired_leaders))
+		npop = kprobe_queue_drain_retired(qq);
+
+	if (qq->flags & QQ_BATCH_DRAIN) {
+		n = kprobe_queue_populate_batch(qq,
+		    start != 0 ? start : now64());
+		if (n == -1)
+			return (-1);
+		npop += n;
+		if (qq->flags & QQ_RING_GROW)
+			kprobe_queue_grow_all(qq);
+		if (qq->flags & QQ_WATERMARK)
+			kprobe_queue_watermark(qq, start);
+
+		return (npop);
+	}
+
+	TAILQ_FOREACH(pgl, &kqq->perf_group_leaders, entry) {
+		qq->cpu_stats[pgl->cpu].fill =
+		    perf_mmap_load_head(pgl->mmap.metadata) -
+		    pgl->mmap.data_tmp_tail;
+	}
 
 	/*
 	 * We stop if the queue is full, or if we see all perf ring buffers
@@ -1266,14 +1854,17 @@ kprobe_queue_populate(struct quark_queue *qq)
 	while (qq->length < qq->max_length) {
 		empty_rings = 0;
 		TAILQ_FOREACH(pgl, &kqq->perf_group_leaders, entry) {
-			ev = perf_mmap_read(&pgl->mmap);
+			ev = perf_mmap_read(&pgl->mmap,
+			    perf_mmap_load_head(pgl->mmap.metadata));
 			if (ev == NULL) {
 				empty_rings++;
 				continue;
 			}
 			empty_rings = 0;
+			kprobe_cpu_stats(qq, pgl, ev);
 			raw = perf_event_to_raw(qq, ev);
 			if (raw != NULL) {
+				pgl->last_time = raw->time;
 				raw_event_insert(qq, raw);
 				npop++;
 			}
@@ -1283,13 +1874,18 @@ kprobe_queue_populate(struct quark_queue *qq)
 			break;
 	}
 
+	if (qq->flags & QQ_RING_GROW)
+		kprobe_queue_grow_all(qq);
+	if (qq->flags & QQ_WATERMARK)
+		kprobe_queue_watermark(qq, start);
+
 	return (npop);
 }
 
 static int
 kprobe_queue_update_stats(struct quark_queue *qq)
 {
-	/* NADA */
+	/* lost and cpu_stats are accounted as records are read */
 	return (0);
 }
 
@@ -1299,24 +1895,17 @@ kprobe_queue_close(struct quark_queue *qq)
 	struct kprobe_queue		*kqq = qq->queue_be;
 	struct perf_group_leader	*pgl;
 	struct kprobe_state		*ks;
+	int				 i;
 
 	if (kqq != NULL) {
 		/* Stop and close the perf rings */
 		while ((pgl = TAILQ_FIRST(&kqq->perf_group_leaders)) != NULL) {
-			/* XXX PERF_IOC_FLAG_GROUP see bugs */
-			if (pgl->fd != -1) {
-				if (ioctl(pgl->fd, PERF_EVENT_IOC_DISABLE,
-				    PERF_IOC_FLAG_GROUP) == -1)
-					warnx("ioctl PERF_EVENT_IOC_DISABLE:");
-				close(pgl->fd);
-			}
-			if (pgl->mmap.metadata != NULL) {
-				if (munmap(pgl->mmap.metadata,
-				    pgl->mmap.mapped_size) != 0)
-					warn("munmap");
-			}
 			TAILQ_REMOVE(&kqq->perf_group_leaders, pgl, entry);
-			free(pgl);
+			perf_close_group_leader(pgl);
+		}
+		while ((pgl = TAILQ_FIRST(&kqq->retired_leaders)) != NULL) {
+			TAILQ_REMOVE(&kqq->retired_leaders, pgl, entry);
+			perf_close_group_leader(pgl);
 		}
 		/* Clean up all state allocated to kprobes */
 		while ((ks = TAILQ_FIRST(&kqq->kprobe_states)) != NULL) {
@@ -1327,10 +1916,16 @@ kprobe_queue_close(struct quark_queue *qq)
 		}
 
 		kprobe_uninstall_all(kqq->qid);
+		for (i = 0; i < (int)nitems(kqq->filters); i++)
+			free(kqq->filters[i]);
+		free(kqq->ready);
 		free(kqq);
 		kqq = NULL;
 		qq->queue_be = NULL;
 	}
+	free(qq->cpu_stats);
+	qq->cpu_stats = NULL;
+	qq->num_cpus = 0;
 	/* Clean up epoll instance */
 	if (qq->epollfd != -1) {
 		close(qq->epollfd);
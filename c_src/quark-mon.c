@@ -4,21 +4,38 @@
 #include <err.h>
 #include <errno.h>
 #include <grp.h>
+#include <limits.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "quark.h"
 
 static int gotsigint;
 
+static void
+histogram_dump(const char *name, struct quark_histogram *h)
+{
+	int	i;
+
+	printf("%8llu %s mean %llu max %llu\n", h->count, name,
+	    h->count ? h->sum / h->count : 0, h->max);
+	for (i = 0; i < QUARK_HIST_BUCKETS; i++) {
+		if (h->bucket[i] == 0)
+			continue;
+		printf("\t< 2^%-2d %8llu\n", i, h->bucket[i]);
+	}
+}
+
 static void
 quark_queue_dump_stats(struct quark_queue *qq)
 {
+	struct quark_queue_histograms h;
 	struct quark_queue_stats s;
 
 	quark_queue_get_stats(qq, &s);
@@ -26,6 +43,50 @@ quark_queue_dump_stats(struct quark_queue *qq)
 	    "%8llu non-aggregations %8llu lost\n",
 	    s.insertions, s.removals, s.aggregations,
 	    s.non_aggregations, s.lost);
+	printf("%8llu slab_peak %8llu slab_retained\n",
+	    s.slab_peak, s.slab_retained);
+	printf("%8llu strtab_entries %8llu strtab_bytes %8llu strtab_saved "
+	    "%8llu strtab_copy_saved\n", s.strtab_entries, s.strtab_bytes,
+	    s.strtab_saved, s.strtab_copy_saved);
+	printf("%8llu populates %8llu cycles_populate %8llu cycles_pop "
+	    "%8llu cycles_process %8llu cycles_gc %8llu cycles_insert\n",
+	    s.populates, s.cycles_populate, s.cycles_pop, s.cycles_process,
+	    s.cycles_gc, s.cycles_insert);
+	printf("%8llu hold_target %8llu late %8llu wakeups %8llu filtered\n",
+	    s.hold_target, s.late, s.wakeups, s.filtered);
+
+	quark_queue_get_histograms(qq, &h);
+	histogram_dump("ingest_ns", &h.ingest);
+	histogram_dump("hold_ns", &h.hold);
+	histogram_dump("depth", &h.depth);
+	histogram_dump("fan_in", &h.fan_in);
+	histogram_dump("cache_size", &h.cache_size);
+}
+
+static void
+quark_queue_dump_cpu_stats(struct quark_queue *qq)
+{
+	struct quark_cpu_stats	*cs;
+	int			 n, i;
+
+	if ((n = quark_queue_get_cpu_stats(qq, NULL, 0)) == -1) {
+		warn("quark_queue_get_cpu_stats");
+		return;
+	}
+	if ((cs = calloc(n, sizeof(*cs))) == NULL)
+		err(1, "calloc");
+	if (quark_queue_get_cpu_stats(qq, cs, n) == -1) {
+		warn("quark_queue_get_cpu_stats");
+		free(cs);
+		return;
+	}
+	printf("%4s %10s %10s %14s %10s %10s\n",
+	    "cpu", "lost", "sent", "bytes", "fill", "size");
+	for (i = 0; i < n; i++)
+		printf("%4d %10llu %10llu %14llu %10llu %10llu\n", i,
+		    cs[i].lost, cs[i].sent, cs[i].bytes, cs[i].fill,
+		    cs[i].size);
+	free(cs);
 }
 
 static void
@@ -58,11 +119,50 @@ priv_drop(void)
 		err(1, "error dropping privileges");
 }
 
+/*
+ * Parse type:value, as in pid:1, tgid:1, uid:0, comm:kworker or cgroup:1234.
+ */
+static void
+filter_parse(const char *s, struct quark_filter *f)
+{
+	const char	*v, *errstr;
+
+	bzero(f, sizeof(*f));
+	if ((v = strchr(s, ':')) == NULL || v[1] == 0)
+		errx(1, "invalid filter %s", s);
+	v++;
+	if (!strncmp(s, "pid:", 4))
+		f->type = QUARK_FILTER_PID;
+	else if (!strncmp(s, "tgid:", 5))
+		f->type = QUARK_FILTER_TGID;
+	else if (!strncmp(s, "uid:", 4))
+		f->type = QUARK_FILTER_UID;
+	else if (!strncmp(s, "comm:", 5)) {
+		f->type = QUARK_FILTER_COMM;
+		if (strlen(v) > sizeof(f->comm))
+			errx(1, "filter comm too long: %s", v);
+		memcpy(f->comm, v, strlen(v));
+		return;
+	} else if (!strncmp(s, "cgroup:", 7)) {
+		f->type = QUARK_FILTER_CGROUP;
+		f->cgroup = strtonum(v, 1, LLONG_MAX, &errstr);
+		if (errstr != NULL)
+			errx(1, "invalid filter cgroup: %s", errstr);
+		return;
+	} else
+		errx(1, "invalid filter type %s", s);
+
+	f->id = strtonum(v, 0, UINT32_MAX, &errstr);
+	if (errstr != NULL)
+		errx(1, "invalid filter id: %s", errstr);
+}
+
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-bDefkstv] "
-	    "[-C filename ] [-l maxlength] [-m maxnodes]\n",
+	fprintf(stderr, "usage: %s [-bDefGikLMNPstvw] "
+	    "[-C filename ] [-F filter] [-l maxlength] [-m maxnodes]\n"
+	    "\t[-p percentile] [-r pages] [-S interval]\n",
 	    program_invocation_short_name);
 
 	exit(1);
@@ -72,9 +172,11 @@ int
 main(int argc, char *argv[])
 {
 	int				 ch, maxnodes, n, i;
-	int				 do_priv_drop, nqevs;
+	int				 do_priv_drop, nqevs, cpu_interval;
+	time_t				 cpu_last, now;
 	struct quark_queue		*qq;
 	struct quark_queue_attr		 qa;
+	struct quark_filter		*filters;
 	struct quark_event		*qev, *qevs;
 	struct sigaction		 sigact;
 	FILE				*graph_by_time, *graph_by_pidtime, *graph_cache;
@@ -84,9 +186,11 @@ main(int argc, char *argv[])
 	maxnodes = -1;
 	do_priv_drop = 0;
 	nqevs = 32;
+	cpu_interval = 0;
+	filters = NULL;
 	graph_by_time = graph_by_pidtime = graph_cache = NULL;
 
-	while ((ch = getopt(argc, argv, "bC:Degklm:tsv")) != -1) {
+	while ((ch = getopt(argc, argv, "bC:DeF:GgikLlm:MNp:Pr:S:tsvw")) != -1) {
 		const char *errstr;
 
 		switch (ch) {
@@ -104,12 +208,29 @@ main(int argc, char *argv[])
 		case 'e':
 			qa.flags |= QQ_ENTRY_LEADER;
 			break;
+		case 'F':
+			filters = reallocarray(filters, qa.nfilters + 1,
+			    sizeof(*filters));
+			if (filters == NULL)
+				err(1, "reallocarray");
+			filter_parse(optarg, &filters[qa.nfilters++]);
+			qa.filters = filters;
+			break;
+		case 'G':
+			qa.flags |= QQ_RING_GROW;
+			break;
 		case 'g':
 			qa.flags |= QQ_MIN_AGG;
 			break;
+		case 'i':
+			qa.flags |= QQ_BPF_SNAPSHOT;
+			break;
 		case 'k':
 			qa.flags |= QQ_KPROBE;
 			break;
+		case 'L':
+			qa.flags |= QQ_LAZY_WAKEUP;
+			break;
 		case 'l':
 			if (optarg == NULL)
 				usage();
@@ -132,6 +253,36 @@ main(int argc, char *argv[])
 			if (graph_by_pidtime == NULL)
 				err(1, "fopen");
 			break;
+		case 'M':
+			qa.field_mask = QUARK_F_PROC;
+			break;
+		case 'N':
+			qa.flags |= QQ_RINGBUF_PERNODE;
+			break;
+		case 'P':
+			qa.flags |= QQ_RINGBUF_PERCPU;
+			break;
+		case 'p':
+			if (optarg == NULL)
+				usage();
+			qa.hold_percentile = strtonum(optarg, 1, 100, &errstr);
+			if (errstr != NULL)
+				errx(1, "invalid percentile: %s", errstr);
+			break;
+		case 'r':
+			if (optarg == NULL)
+				usage();
+			qa.ring_pages = strtonum(optarg, 1, 1 << 20, &errstr);
+			if (errstr != NULL)
+				errx(1, "invalid ring pages: %s", errstr);
+			break;
+		case 'S':
+			if (optarg == NULL)
+				usage();
+			cpu_interval = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(1, "invalid interval: %s", errstr);
+			break;
 		case 's':
 			qa.flags |= QQ_NO_SNAPSHOT;
 			break;
@@ -141,6 +292,9 @@ main(int argc, char *argv[])
 		case 'v':
 			quark_verbose++;
 			break;
+		case 'w':
+			qa.flags |= QQ_WATERMARK;
+			break;
 		default:
 			usage();
 		}
@@ -171,22 +325,29 @@ main(int argc, char *argv[])
 	 */
 	while (!gotsigint && maxnodes != -1 && qq->length < maxnodes) {
 		quark_queue_populate(qq);
-		quark_queue_block(qq);
+		quark_queue_block(qq, 100);
 	}
 
 	/*
 	 * Normal mode, collect, pop and dump elements until we get a sigint
 	 */
+	cpu_last = time(NULL);
 	while (!gotsigint && maxnodes == -1) {
+		if (cpu_interval &&
+		    (now = time(NULL)) - cpu_last >= cpu_interval) {
+			quark_queue_dump_cpu_stats(qq);
+			cpu_last = now;
+		}
 		n = quark_queue_get_events(qq, qevs, nqevs);
 		if (n == -1)
 			err(1, "quark_queue_get_events");
 		/* Scan each event */
 		for (i = 0, qev = qevs; i < n; i++, qev++)
 			quark_event_dump(qev, stdout);
-		/* No events, just block */
+		/* No events, block until quark has work or it's time for stats */
 		if (n == 0) {
-			quark_queue_block(qq);
+			quark_queue_block(qq, cpu_interval ?
+			    cpu_interval * 1000 : -1);
 			continue;
 		}
 	}
@@ -210,6 +371,7 @@ main(int argc, char *argv[])
 	quark_queue_dump_stats(qq);
 	quark_queue_close(qq);
 	free(qq);
+	free(filters);
 
 	return (0);
 }
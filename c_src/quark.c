@@ -2,13 +2,16 @@
 /* Copyright (c) 2024 Elastic NV */
 
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include <ctype.h>
+#include <stddef.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fts.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +27,8 @@
 static int	raw_event_by_time_cmp(struct raw_event *, struct raw_event *);
 static int	raw_event_by_pidtime_cmp(struct raw_event *, struct raw_event *);
 static int	process_by_pid_cmp(struct quark_process *, struct quark_process *);
+static int	thread_by_tid_cmp(struct quark_thread *, struct quark_thread *);
+static int	istr_by_value_cmp(struct istr *, struct istr *);
 
 /* For debugging */
 int	quark_verbose;
@@ -33,6 +38,16 @@ RB_PROTOTYPE(process_by_pid, quark_process,
 RB_GENERATE(process_by_pid, quark_process,
     entry_by_pid, process_by_pid_cmp);
 
+RB_PROTOTYPE(thread_by_tid, quark_thread,
+    entry_by_tid, thread_by_tid_cmp);
+RB_GENERATE(thread_by_tid, quark_thread,
+    entry_by_tid, thread_by_tid_cmp);
+
+RB_PROTOTYPE(istr_by_value, istr,
+    entry, istr_by_value_cmp);
+RB_GENERATE(istr_by_value, istr,
+    entry, istr_by_value_cmp);
+
 RB_PROTOTYPE(raw_event_by_time, raw_event,
     entry_by_time, raw_event_by_time_cmp);
 RB_GENERATE(raw_event_by_time, raw_event,
@@ -48,14 +63,80 @@ struct quark {
 	u64		boottime;
 } quark;
 
+/*
+ * Each raw event type gets its own size class, so a RAW_COMM doesn't pay for
+ * the space of a RAW_EXEC.
+ */
+#define RAW_EVENT_SIZE(_m)						\
+	(offsetof(struct raw_event, _m) + sizeof(((struct raw_event *)0)->_m))
+static const size_t raw_event_size[RAW_NUM_TYPES] = {
+	[RAW_EXEC]		= RAW_EVENT_SIZE(exec),
+	[RAW_WAKE_UP_NEW_TASK]	= RAW_EVENT_SIZE(task),
+	[RAW_EXIT_THREAD]	= RAW_EVENT_SIZE(task),
+	[RAW_COMM]		= RAW_EVENT_SIZE(comm),
+	[RAW_EXEC_CONNECTOR]	= RAW_EVENT_SIZE(exec_connector),
+};
+#undef RAW_EVENT_SIZE
+
+static void
+raw_event_slab_init(struct quark_queue *qq)
+{
+	int	type;
+
+	for (type = 0; type < RAW_NUM_TYPES; type++) {
+		TAILQ_INIT(&qq->raw_event_slab[type].free);
+		qq->raw_event_slab[type].nfree = 0;
+	}
+}
+
+static void
+raw_event_slab_destroy(struct quark_queue *qq)
+{
+	struct raw_event_slab	*slab;
+	struct raw_event	*raw;
+	int			 type;
+
+	for (type = 0; type < RAW_NUM_TYPES; type++) {
+		slab = &qq->raw_event_slab[type];
+		while ((raw = TAILQ_FIRST(&slab->free)) != NULL) {
+			TAILQ_REMOVE(&slab->free, raw, agg_entry);
+			slab->nfree--;
+			qq->stats.slab_retained -= raw_event_size[type];
+			free(raw);
+		}
+	}
+}
+
 struct raw_event *
-raw_event_alloc(int type)
+raw_event_alloc(struct quark_queue *qq, int type)
 {
-	struct raw_event *raw;
+	struct raw_event_slab	*slab;
+	struct raw_event	*raw;
+	size_t			 size;
 
-	if ((raw = calloc(1, sizeof(*raw))) == NULL)
+	if (type <= RAW_INVALID || type >= RAW_NUM_TYPES) {
+		warnx("%s: unhandled raw_type %d", __func__, type);
+		return (NULL);
+	}
+	slab = &qq->raw_event_slab[type];
+	size = raw_event_size[type];
+
+	/*
+	 * Free nodes are linked through agg_entry, which is unused until the
+	 * node is aggregated.
+	 */
+	raw = TAILQ_FIRST(&slab->free);
+	if (raw != NULL) {
+		TAILQ_REMOVE(&slab->free, raw, agg_entry);
+		slab->nfree--;
+		qq->stats.slab_retained -= size;
+		bzero(raw, size);
+	} else if ((raw = calloc(1, size)) == NULL)
 		return (NULL);
 
+	if (++qq->slab_alive > qq->stats.slab_peak)
+		qq->stats.slab_peak = qq->slab_alive;
+
 	raw->type = type;
 	TAILQ_INIT(&raw->agg_queue);
 
@@ -76,19 +157,16 @@ raw_event_alloc(int type)
 		break;
 	case RAW_COMM:		/* nada */
 		break;
-	default:
-		warnx("%s: unhandled raw_type %d", __func__, raw->type);
-		free(raw);
-		return (NULL);
 	}
 
 	return (raw);
 }
 
 void
-raw_event_free(struct raw_event *raw)
+raw_event_free(struct quark_queue *qq, struct raw_event *raw)
 {
-	struct raw_event *aux;
+	struct raw_event_slab	*slab;
+	struct raw_event	*aux;
 
 	switch (raw->type) {
 	case RAW_WAKE_UP_NEW_TASK:
@@ -102,46 +180,78 @@ raw_event_free(struct raw_event *raw)
 		break;
 	case RAW_EXEC_CONNECTOR:
 		qstr_free(&raw->exec_connector.args);
+		qstr_free(&raw->exec_connector.task.cwd);
 		break;
 	case RAW_COMM:		/* nada */
 		break;
 	default:
 		warnx("%s: unhandled raw_type %d", __func__, raw->type);
-		break;
+		free(raw);
+		return;
 	}
 
 	while ((aux = TAILQ_FIRST(&raw->agg_queue)) != NULL) {
 		TAILQ_REMOVE(&raw->agg_queue, aux, agg_entry);
-		raw_event_free(aux);
+		raw_event_free(qq, aux);
 	}
 
-	free(raw);
+	qq->slab_alive--;
+	slab = &qq->raw_event_slab[raw->type];
+	/*
+	 * Keep at most max_length free nodes of each type, more than that is
+	 * a burst that went away.
+	 */
+	if (slab->nfree >= (u64)qq->max_length) {
+		free(raw);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&slab->free, raw, agg_entry);
+	slab->nfree++;
+	qq->stats.slab_retained += raw_event_size[raw->type];
 }
 
-static int
-raw_event_by_time_cmp(struct raw_event *a, struct raw_event *b)
+/*
+ * Events are keyed by (time, cpu, seq), timestamps do collide, specially when
+ * many cpus fork at once, cpu keeps ties stable across rings and seq, unique
+ * per queue, makes the key unique.
+ */
+static inline int
+raw_event_key_cmp(struct raw_event *a, struct raw_event *b)
 {
 	if (a->time < b->time)
 		return (-1);
+	else if (a->time > b->time)
+		return (1);
+
+	if (a->cpu < b->cpu)
+		return (-1);
+	else if (a->cpu > b->cpu)
+		return (1);
+
+	if (a->seq < b->seq)
+		return (-1);
 	else
-		return (a->time > b->time);
+		return (a->seq > b->seq);
+}
+
+static int
+raw_event_by_time_cmp(struct raw_event *a, struct raw_event *b)
+{
+	return (raw_event_key_cmp(a, b));
 }
 
 static int
 raw_event_by_pidtime_cmp(struct raw_event *a, struct raw_event *b)
 {
-	if (a->pid < b->pid)
+	if (a->cluster < b->cluster)
 		return (-1);
-	else if (a->pid > b->pid)
+	else if (a->cluster > b->cluster)
 		return (1);
 
-	if (a->time < b->time)
-		return (-1);
-	else
-		return (a->time > b->time);
+	return (raw_event_key_cmp(a, b));
 }
 
-static inline u64
+u64
 now64(void)
 {
 	struct timespec ts;
@@ -152,6 +262,48 @@ now64(void)
 	return ((u64)ts.tv_sec * (u64)NS_PER_S + (u64)ts.tv_nsec);
 }
 
+/*
+ * Cheap cycle counter for the per-stage stats, only differences are
+ * meaningful and the unit depends on the architecture.
+ */
+static inline u64
+cycles(void)
+{
+#if defined(__x86_64__)
+	return (__builtin_ia32_rdtsc());
+#elif defined(__aarch64__)
+	u64	v;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+
+	return (v);
+#else
+	return (now64());
+#endif
+}
+
+static inline int
+hist_bucket(u64 v)
+{
+	if (v == 0)
+		return (0);
+
+	return (min(64 - __builtin_clzll(v), QUARK_HIST_BUCKETS - 1));
+}
+
+/*
+ * Fixed buckets and no allocation, cheap enough to be always on.
+ */
+static inline void
+hist_add(struct quark_histogram *h, u64 v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->bucket[hist_bucket(v)]++;
+}
+
 static inline u64
 raw_event_age(struct raw_event *raw, u64 now)
 {
@@ -165,11 +317,14 @@ raw_event_age(struct raw_event *raw, u64 now)
  * from [0; 10%]    -> 1000ms
  * from [90%; 100%] -> 0ms
  * from (10%; 90%)  -> linear from 1000ms -> 100ms
+ * With a hold_percentile the measured skew caps it further, memory pressure
+ * still wins, see raw_event_skew().
  */
 static u64
 raw_event_target_age(struct quark_queue *qq)
 {
 	int	v;
+	u64	target;
 
 	if (qq->length < (qq->max_length / 10))
 		v = qq->hold_time;
@@ -179,7 +334,30 @@ raw_event_target_age(struct quark_queue *qq)
 	} else
 		v = 0;
 
-	return ((u64)MS_TO_NS(v));
+	target = MS_TO_NS(v);
+	if (qq->hold_percentile)
+		target = min(target, qq->hold_target);
+
+	return (target);
+}
+
+/*
+ * With QQ_WATERMARK the backend tracks the latest timestamp seen on each ring
+ * and publishes the lowest one in qq->watermark. No ring will give us anything
+ * older than the watermark, so once an event is older than the watermark plus
+ * the aggregation window, it can't be reordered nor aggregated anymore and
+ * there is no point in holding it further. Rings that were found empty on
+ * populate count as being at the time populate started, any event that is
+ * still in flight to that ring is then younger than the watermark minus a few
+ * microseconds, which is why the aggregation window must never be zero.
+ */
+static inline int
+raw_event_watermarked(struct quark_queue *qq, struct raw_event *raw)
+{
+	if ((qq->flags & QQ_WATERMARK) == 0 || qq->watermark == 0)
+		return (0);
+
+	return (raw->time + qq->agg_window <= qq->watermark);
 }
 
 static inline int
@@ -187,64 +365,214 @@ raw_event_expired(struct quark_queue *qq, struct raw_event *raw, u64 now)
 {
 	u64	target;
 
+	if (raw_event_watermarked(qq, raw))
+		return (1);
+
 	target = raw_event_target_age(qq);
 	return (raw_event_age(raw, now) >= target);
 }
 
 /*
- * Insert without a colision, cheat on the timestamp in case we do. NOTE: since
- * we bump "time" here, we shouldn't copy "time" before it sits in the tree.
+ * QQ_HOLD_HEAP, 4-ary min-heap of raw events. Four children per node make for
+ * a shallow heap where siblings share a cache line of pointers.
  */
-void
-raw_event_insert(struct quark_queue *qq, struct raw_event *raw)
+#define HEAP_PARENT(_i)	(((_i) - 1) >> 2)
+#define HEAP_CHILD(_i)	(((_i) << 2) + 1)
+
+static inline void
+raw_event_heap_set(struct raw_event_heap *h, u32 i, struct raw_event *raw)
+{
+	h->v[i] = raw;
+	raw->heap_idx = i;
+}
+
+static void
+raw_event_heap_up(struct raw_event_heap *h, u32 i)
 {
-	struct raw_event	*col;
-	int			 attempts = 10;
+	struct raw_event	*raw = h->v[i];
+	u32			 p;
 
-	/*
-	 * Link it first by time
-	 */
-	do {
-		col = RB_INSERT(raw_event_by_time, &qq->raw_event_by_time, raw);
-		if (likely(col == NULL))
+	while (i > 0) {
+		p = HEAP_PARENT(i);
+		if (raw_event_key_cmp(raw, h->v[p]) >= 0)
 			break;
+		raw_event_heap_set(h, i, h->v[p]);
+		i = p;
+	}
+	raw_event_heap_set(h, i, raw);
+}
 
-		/*
-		 * We managed to get a collision on the TSC, this happens!
-		 * We just bump time by one until we can insert it.
-		 */
-		raw->time++;
-		warnx("raw_event_by_time collision");
-	} while (--attempts > 0);
+static void
+raw_event_heap_down(struct raw_event_heap *h, u32 i)
+{
+	struct raw_event	*raw = h->v[i];
+	u32			 c, end, best;
+
+	while ((c = HEAP_CHILD(i)) < h->len) {
+		end = min(c + 4, h->len);
+		for (best = c++; c < end; c++) {
+			if (raw_event_key_cmp(h->v[c], h->v[best]) < 0)
+				best = c;
+		}
+		if (raw_event_key_cmp(h->v[best], raw) >= 0)
+			break;
+		raw_event_heap_set(h, i, h->v[best]);
+		i = best;
+	}
+	raw_event_heap_set(h, i, raw);
+}
+
+static int
+raw_event_heap_push(struct raw_event_heap *h, struct raw_event *raw)
+{
+	struct raw_event	**v;
+	u32			  size;
 
-	if (unlikely(col != NULL))
-		err(1, "we got consecutive collisions, this is a bug");
+	if (h->len == h->size) {
+		size = h->size == 0 ? 1024 : h->size * 2;
+		if ((v = reallocarray(h->v, size, sizeof(*v))) == NULL)
+			return (-1);
+		h->v = v;
+		h->size = size;
+	}
+	raw_event_heap_set(h, h->len++, raw);
+	raw_event_heap_up(h, raw->heap_idx);
 
-	/*
-	 * Link it in the combined tree, we accept no collisions here as the
-	 * above case already saves us, but trust nothing.
-	 */
-	/* XXX this should be by tid, but we're not there yet XXX */
-	col = RB_INSERT(raw_event_by_pidtime, &qq->raw_event_by_pidtime, raw);
-	if (unlikely(col != NULL))
-		err(1, "collision on pidtime tree, this is a bug");
+	return (0);
+}
+
+static void
+raw_event_heap_remove(struct raw_event_heap *h, struct raw_event *raw)
+{
+	struct raw_event	*last;
+	u32			 i = raw->heap_idx;
+
+	last = h->v[--h->len];
+	if (i == h->len)
+		return;
+	raw_event_heap_set(h, i, last);
+	if (i > 0 && raw_event_key_cmp(last, h->v[HEAP_PARENT(i)]) < 0)
+		raw_event_heap_up(h, i);
+	else
+		raw_event_heap_down(h, i);
+}
+
+/*
+ * Adaptive hold. The skew of an event is how far behind the newest event seen
+ * so far it arrives, which is how much it had to be held to be put in order.
+ * Skews are kept in a log2 histogram and every SKEW_SAMPLES insertions the
+ * hold target becomes the upper bound of the bucket at hold_percentile, then
+ * the histogram is halved so old samples fade away. The target never goes
+ * below agg_window, so aggregation still has room, nor above hold_time.
+ * Anything older than the last emitted event arrived too late to be ordered,
+ * and is counted in stats.late.
+ */
+#define SKEW_SAMPLES	1024
+
+static void
+raw_event_skew_update(struct quark_queue *qq)
+{
+	u64	total, want, sum, target;
+	int	i;
+
+	total = 0;
+	for (i = 0; i < (int)nitems(qq->skew_hist); i++)
+		total += qq->skew_hist[i];
+	want = (total * qq->hold_percentile + 99) / 100;
+	sum = 0;
+	for (i = 0; i < (int)nitems(qq->skew_hist) - 1; i++) {
+		sum += qq->skew_hist[i];
+		if (sum >= want)
+			break;
+	}
+	target = i == 0 ? 0 : 1ULL << i;
+	target = max(target, qq->agg_window);
+	target = min(target, (u64)MS_TO_NS(qq->hold_time));
+	qq->hold_target = target;
+
+	for (i = 0; i < (int)nitems(qq->skew_hist); i++)
+		qq->skew_hist[i] >>= 1;
+	qq->skew_samples = 0;
+}
+
+static void
+raw_event_skew(struct quark_queue *qq, struct raw_event *raw)
+{
+	if (raw->time < qq->emitted)
+		qq->stats.late++;
+	if (qq->hold_percentile == 0)
+		return;
+
+	if (raw->time > qq->newest)
+		qq->newest = raw->time;
+	qq->skew_hist[hist_bucket(qq->newest - raw->time)]++;
+	if (++qq->skew_samples == SKEW_SAMPLES)
+		raw_event_skew_update(qq);
+}
+
+/*
+ * Link the event in the hold queue and in the pidtime tree, the key is unique
+ * so no insert can collide and time is never touched, see raw_event_key_cmp().
+ * With QQ_THREAD_EVENTS the pidtime tree clusters by tid, so events of one
+ * thread don't have to be walked past when aggregating another.
+ */
+void
+raw_event_insert(struct quark_queue *qq, struct raw_event *raw)
+{
+	u64	c0;
+
+	c0 = cycles();
+	raw_event_skew(qq, raw);
+	raw->seq = qq->seq++;
+	raw->insert_time = qq->populate_time;
+	hist_add(&qq->histos.ingest, AGE(raw->time, raw->insert_time));
+	if ((qq->flags & QQ_THREAD_EVENTS) && raw->tid != 0)
+		raw->cluster = raw->tid;
+	else
+		raw->cluster = raw->pid;
+	if (qq->flags & QQ_HOLD_HEAP) {
+		if (raw_event_heap_push(&qq->raw_event_heap, raw) == -1) {
+			warn("%s: can't grow heap, dropping event", __func__);
+			raw_event_free(qq, raw);
+			return;
+		}
+	} else
+		RB_INSERT(raw_event_by_time, &qq->raw_event_by_time, raw);
+	RB_INSERT(raw_event_by_pidtime, &qq->raw_event_by_pidtime, raw);
 
 	/* if (qq->min == NULL || raw_event_by_time_cmp(raw, qq->min) == -1) */
 	/* 	qq->min = raw; */
 	qq->length++;
 	qq->stats.insertions++;
+	qq->stats.cycles_insert += cycles() - c0;
 }
 
-static void
+void
 raw_event_remove(struct quark_queue *qq, struct raw_event *raw)
 {
-	RB_REMOVE(raw_event_by_time, &qq->raw_event_by_time, raw);
+	if (qq->flags & QQ_HOLD_HEAP)
+		raw_event_heap_remove(&qq->raw_event_heap, raw);
+	else
+		RB_REMOVE(raw_event_by_time, &qq->raw_event_by_time, raw);
 	RB_REMOVE(raw_event_by_pidtime, &qq->raw_event_by_pidtime, raw);
 	/* if (qq->min == raw) qq->min = NULL */
 	qq->length--;
 	qq->stats.removals++;
 }
 
+/*
+ * Oldest event in the hold queue
+ */
+struct raw_event *
+raw_event_min(struct quark_queue *qq)
+{
+	if (qq->flags & QQ_HOLD_HEAP)
+		return (qq->raw_event_heap.len > 0 ?
+		    qq->raw_event_heap.v[0] : NULL);
+
+	return (RB_MIN(raw_event_by_time, &qq->raw_event_by_time));
+}
+
 static int
 tty_type(int major, int minor)
 {
@@ -343,14 +671,178 @@ event_copy_out(struct quark_process *dst, struct quark_process *src, u64 events)
 	event_copy_fields(dst, src);
 }
 #endif
+
+/*
+ * Strings of a cached process are interned in qq->istr_by_value, processes
+ * sharing the same filename or cwd point to the same struct istr, and a fork
+ * only bumps the reference count of its parent strings. The terminating NUL is
+ * always added but never counted in the lengths.
+ */
+#define ISTR(_s)	((struct istr *)(uintptr_t)((_s) - offsetof(struct istr, p)))
+
+/* FNV-1a */
+static u64
+istr_hash(const char *s, size_t len)
+{
+	u64	h = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h ^= (u8)*s++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return (h);
+}
+
+static const char *
+istr_get(struct quark_queue *qq, const char *src, size_t len)
+{
+	struct istr	 key, *is;
+	size_t		 size;
+
+	key.hash = istr_hash(src, len);
+	key.len = len;
+	key.v = src;
+	is = RB_FIND(istr_by_value, &qq->istr_by_value, &key);
+	if (is != NULL) {
+		is->refs++;
+		qq->stats.strtab_saved += len + 1;
+		qq->stats.strtab_copy_saved += len + 1;
+
+		return (is->p);
+	}
+
+	size = sizeof(*is) + len + 1;
+	if ((is = malloc(size)) == NULL)
+		return (NULL);
+	is->hash = key.hash;
+	is->len = len;
+	is->refs = 1;
+	memcpy(is->p, src, len);
+	is->p[len] = 0;
+	is->v = is->p;
+	if (RB_INSERT(istr_by_value, &qq->istr_by_value, is) != NULL) {
+		warnx("istr collision, this is a bug");
+		free(is);
+		return (NULL);
+	}
+	qq->stats.strtab_entries++;
+	qq->stats.strtab_bytes += size;
+	qq->stats.cache_bytes += size;
+
+	return (is->p);
+}
+
+static const char *
+istr_ref(struct quark_queue *qq, const char *s)
+{
+	struct istr	*is = ISTR(s);
+
+	is->refs++;
+	qq->stats.strtab_saved += is->len + 1;
+	qq->stats.strtab_copy_saved += is->len + 1;
+
+	return (s);
+}
+
+static void
+istr_put(struct quark_queue *qq, const char **s)
+{
+	struct istr	*is;
+	size_t		 size;
+
+	if (*s == NULL)
+		return;
+	is = ISTR(*s);
+	*s = NULL;
+	if (--is->refs > 0) {
+		qq->stats.strtab_saved -= is->len + 1;
+		return;
+	}
+	RB_REMOVE(istr_by_value, &qq->istr_by_value, is);
+	size = sizeof(*is) + is->len + 1;
+	qq->stats.strtab_entries--;
+	qq->stats.strtab_bytes -= size;
+	qq->stats.cache_bytes -= size;
+	free(is);
+}
+
+static int
+process_string_set(struct quark_queue *qq, const char **s, const char *src,
+    size_t len)
+{
+	const char	*p;
+
+	/* Get before put, src might be *s itself */
+	if ((p = istr_get(qq, src, len)) == NULL)
+		return (-1);
+	istr_put(qq, s);
+	*s = p;
+
+	return (0);
+}
+
+static void
+process_string_ref(struct quark_queue *qq, const char **s, const char *src)
+{
+	src = istr_ref(qq, src);
+	istr_put(qq, s);
+	*s = src;
+}
+
+static int
+process_set_filename(struct quark_queue *qq, struct quark_process *qp,
+    const char *filename)
+{
+	if (process_string_set(qq, &qp->filename, filename,
+	    strlen(filename)) == -1)
+		return (-1);
+	qp->flags |= QUARK_F_FILENAME;
+
+	return (0);
+}
+
+static int
+process_set_cwd(struct quark_queue *qq, struct quark_process *qp,
+    const char *cwd)
+{
+	if ((qq->field_mask & QUARK_F_CWD) == 0)
+		return (0);
+	if (process_string_set(qq, &qp->cwd, cwd, strlen(cwd)) == -1)
+		return (-1);
+	qp->flags |= QUARK_F_CWD;
+
+	return (0);
+}
+
+static int
+process_set_cmdline(struct quark_queue *qq, struct quark_process *qp,
+    const char *cmdline, size_t cmdline_len)
+{
+	size_t	len;
+
+	if ((qq->field_mask & QUARK_F_CMDLINE) == 0)
+		return (0);
+	/*
+	 * paranoia, args_make() wants the last argument terminated, interning
+	 * one byte less has the added NUL take the place of the last byte.
+	 */
+	len = cmdline_len > 0 ? cmdline_len - 1 : 0;
+	if (process_string_set(qq, &qp->cmdline, cmdline, len) == -1)
+		return (-1);
+	qp->cmdline_len = cmdline_len;
+	qp->flags |= QUARK_F_CMDLINE;
+
+	return (0);
+}
+
 static struct quark_process *
 process_cache_get(struct quark_queue *qq, int pid, int alloc)
 {
-	struct quark_process	 key;
 	struct quark_process	*qp;
 
-	key.pid = pid;
-	qp = RB_FIND(process_by_pid, &qq->process_by_pid, &key);
+	/* process_by_pid is only for ordered walks, lookups go to the index */
+	qp = pid_index_find(&qq->pid_index, pid);
 	if (qp != NULL)
 		return (qp);
 
@@ -363,15 +855,53 @@ process_cache_get(struct quark_queue *qq, int pid, int alloc)
 	if (qp == NULL)
 		return (NULL);
 	qp->pid = pid;
+	LIST_INIT(&qp->children);
+	if (pid_index_insert(&qq->pid_index, qp) == -1) {
+		free(qp);
+		return (NULL);
+	}
 	if (RB_INSERT(process_by_pid, &qq->process_by_pid, qp) != NULL) {
 		warnx("collision, this is a bug");
+		pid_index_remove(&qq->pid_index, qp);
 		free(qp);
 		return (NULL);
 	}
+	qq->stats.cache_entries++;
+	qq->stats.cache_bytes += sizeof(*qp);
 
 	return (qp);
 }
 
+static void
+process_unlink_parent(struct quark_process *qp)
+{
+	if (qp->parent == NULL)
+		return;
+	LIST_REMOVE(qp, entry_sibling);
+	qp->parent = NULL;
+}
+
+/*
+ * Keep qp in the children list of proc_ppid, this is called whenever
+ * proc_ppid is (re)set, so a reparent is caught on the next event of the
+ * child. If the parent is not cached, qp is left unlinked.
+ */
+static void
+process_link_parent(struct quark_queue *qq, struct quark_process *qp)
+{
+	struct quark_process	*parent;
+
+	if (qp->parent != NULL && qp->parent->pid == qp->proc_ppid)
+		return;
+	process_unlink_parent(qp);
+	if (qp->proc_ppid == 0 || qp->proc_ppid == qp->pid)
+		return;
+	if ((parent = process_cache_get(qq, qp->proc_ppid, 0)) == NULL)
+		return;
+	LIST_INSERT_HEAD(&parent->children, qp, entry_sibling);
+	qp->parent = parent;
+}
+
 static void
 process_cache_inherit(struct quark_queue *qq, struct quark_process *qp, int ppid)
 {
@@ -388,33 +918,75 @@ process_cache_inherit(struct quark_queue *qq, struct quark_process *qp, int ppid
 	}
 	if (parent->flags & QUARK_F_FILENAME) {
 		qp->flags |= QUARK_F_FILENAME;
-		strlcpy(qp->filename, parent->filename, sizeof(qp->filename));
+		process_string_ref(qq, &qp->filename, parent->filename);
 	}
 	/* Do we really want CMDLINE? */
 	if (parent->flags & QUARK_F_CMDLINE) {
 		qp->flags |= QUARK_F_CMDLINE;
+		process_string_ref(qq, &qp->cmdline, parent->cmdline);
 		qp->cmdline_len = parent->cmdline_len;
-		memcpy(qp->cmdline, parent->cmdline, parent->cmdline_len);
 	}
 }
 
 static void
 process_cache_delete(struct quark_queue *qq, struct quark_process *qp)
 {
+	struct quark_process	*child;
+
 	RB_REMOVE(process_by_pid, &qq->process_by_pid, qp);
+	pid_index_remove(&qq->pid_index, qp);
+	process_unlink_parent(qp);
+	while ((child = LIST_FIRST(&qp->children)) != NULL)
+		process_unlink_parent(child);
 	if (qp->gc_time)
 		TAILQ_REMOVE(&qq->event_gc, qp, entry_gc);
+	istr_put(qq, &qp->filename);
+	istr_put(qq, &qp->cmdline);
+	istr_put(qq, &qp->cwd);
+	qq->stats.cache_entries--;
+	qq->stats.cache_bytes -= sizeof(*qp);
 	free(qp);
 }
 
+static struct quark_thread *
+thread_cache_get(struct quark_queue *qq, u32 tid, u32 pid)
+{
+	struct quark_thread	 key, *qt;
+
+	key.tid = tid;
+	qt = RB_FIND(thread_by_tid, &qq->thread_by_tid, &key);
+	if (qt != NULL)
+		return (qt);
+
+	if ((qt = calloc(1, sizeof(*qt))) == NULL)
+		return (NULL);
+	qt->tid = tid;
+	qt->pid = pid;
+	RB_INSERT(thread_by_tid, &qq->thread_by_tid, qt);
+	qq->stats.thread_entries++;
+	qq->stats.cache_bytes += sizeof(*qt);
+
+	return (qt);
+}
+
+static void
+thread_cache_delete(struct quark_queue *qq, struct quark_thread *qt)
+{
+	RB_REMOVE(thread_by_tid, &qq->thread_by_tid, qt);
+	if (qt->gc_time)
+		TAILQ_REMOVE(&qq->thread_gc, qt, entry_gc);
+	qq->stats.thread_entries--;
+	qq->stats.cache_bytes -= sizeof(*qt);
+	free(qt);
+}
+
 static int
-process_cache_gc(struct quark_queue *qq)
+process_cache_gc(struct quark_queue *qq, u64 now)
 {
 	struct quark_process	*qp;
-	u64			 now;
+	struct quark_thread	*qt;
 	int			 n;
 
-	now = now64();
 	n = 0;
 	while ((qp = TAILQ_FIRST(&qq->event_gc)) != NULL) {
 		if (AGE(qp->gc_time, now) < qq->cache_grace_time)
@@ -422,10 +994,27 @@ process_cache_gc(struct quark_queue *qq)
 		process_cache_delete(qq, qp);
 		n++;
 	}
+	while ((qt = TAILQ_FIRST(&qq->thread_gc)) != NULL) {
+		if (AGE(qt->gc_time, now) < qq->cache_grace_time)
+			break;
+		thread_cache_delete(qq, qt);
+		n++;
+	}
 
 	return (n);
 }
 
+static int
+thread_by_tid_cmp(struct quark_thread *a, struct quark_thread *b)
+{
+	if (a->tid < b->tid)
+		return (-1);
+	else if (a->tid > b->tid)
+		return (1);
+
+	return (0);
+}
+
 static int
 process_by_pid_cmp(struct quark_process *a, struct quark_process *b)
 {
@@ -437,6 +1026,21 @@ process_by_pid_cmp(struct quark_process *a, struct quark_process *b)
 	return (0);
 }
 
+static int
+istr_by_value_cmp(struct istr *a, struct istr *b)
+{
+	if (a->hash < b->hash)
+		return (-1);
+	else if (a->hash > b->hash)
+		return (1);
+	if (a->len < b->len)
+		return (-1);
+	else if (a->len > b->len)
+		return (1);
+
+	return (memcmp(a->v, b->v, a->len));
+}
+
 static const char *
 event_flag_str(u64 flag)
 {
@@ -453,6 +1057,8 @@ event_flag_str(u64 flag)
 		return "CMDLINE";
 	case QUARK_F_CWD:
 		return "CWD";
+	case QUARK_F_CAPS:
+		return "CAPS";
 	default:
 		return "?";
 	}
@@ -501,11 +1107,23 @@ events_type_str(u64 events, char *buf, size_t len)
 	return (0);
 }
 
+static const char *
+process_basename(const struct quark_process *qp)
+{
+	const char	*p;
+
+	if ((qp->flags & QUARK_F_FILENAME) == 0 ||
+	    (p = strrchr(qp->filename, '/')) == NULL)
+		return ("");
+
+	return (p + 1);
+}
+
 static int
 entry_leader_compute(struct quark_queue *qq, struct quark_process *qp)
 {
 	struct quark_process	*parent;
-	char			*basename, *p_basename;
+	const char		*basename, *p_basename;
 	int			 tty;
 	int			 is_ses_leader;
 
@@ -537,11 +1155,7 @@ entry_leader_compute(struct quark_queue *qq, struct quark_process *qp)
 
 	tty = tty_type(qp->proc_tty_major, qp->proc_tty_minor);
 
-	basename = strrchr(qp->filename, '/');
-	if (basename == NULL)
-		basename = "";
-	else
-		basename++;
+	basename = process_basename(qp);
 
 	/*
 	 * CONSOLE only considers the login process, keep the same behaviour
@@ -591,11 +1205,7 @@ entry_leader_compute(struct quark_queue *qq, struct quark_process *qp)
 	    STARTS_WITH(basename, "conmon"))
 		return (0);
 
-	p_basename = strrchr(parent->filename, '/');
-	if (p_basename == NULL)
-		p_basename = "";
-	else
-		p_basename++;
+	p_basename = process_basename(parent);
 
 	/*
 	 * SSM.
@@ -635,102 +1245,53 @@ entry_leader_compute(struct quark_queue *qq, struct quark_process *qp)
 
 	if (qp->proc_entry_leader == QUARK_ELT_UNKNOWN)
 		warnx("%d (%s) is UNKNOWN (tty=%d)",
-		    qp->pid, qp->filename, tty);
+		    qp->pid, basename, tty);
 
 	return (0);
 }
 
-struct proc_node {
-	u32			pid;
-	TAILQ_ENTRY(proc_node)	entry;
-};
-
-TAILQ_HEAD(proc_node_list, proc_node);
-
+/*
+ * Breadth first walk of the children index, parents must be computed before
+ * their children.
+ */
 static int
-entry_leader_build_walklist(struct quark_queue *qq, struct proc_node_list *list)
+entry_leaders_build(struct quark_queue *qq)
 {
-	struct proc_node	*node, *new_node;
-	struct quark_process	*qp;
+	struct quark_process	*qp, *child, **bfs;
+	u64			 n, head, tail;
+
+	if ((qq->flags & QQ_ENTRY_LEADER) == 0)
+		return (0);
 
-	TAILQ_INIT(list);
+	n = qq->stats.cache_entries;
+	if (n == 0)
+		return (0);
+	if ((bfs = calloc(n, sizeof(*bfs))) == NULL)
+		return (-1);
+	head = tail = 0;
 
 	/*
 	 * Look for the root nodes, this is init(pid = 1) and kthread(pid = 2),
 	 * but maybe there's something else in the future or in the past so
 	 * don't hardcode.
 	 */
-
 	RB_FOREACH(qp, process_by_pid, &qq->process_by_pid) {
-		if (qp->proc_ppid != 0)
-			continue;
-
-		new_node = calloc(1, sizeof(*new_node));
-		if (new_node == NULL)
-			goto fail;
-		new_node->pid = qp->pid;
-		TAILQ_INSERT_TAIL(list, new_node, entry);
-	}
-
-	/*
-	 * Now do the "recursion"
-	 */
-	TAILQ_FOREACH(node, list, entry) {
-		RB_FOREACH(qp, process_by_pid, &qq->process_by_pid) {
-			if (qp->proc_ppid != node->pid)
-				continue;
-
-			new_node = calloc(1, sizeof(*new_node));
-			if (new_node == NULL)
-				goto fail;
-			new_node->pid = qp->pid;
-			TAILQ_INSERT_TAIL(list, new_node, entry);
-		}
-	}
-
-	return (0);
-
-fail:
-	while ((node = TAILQ_FIRST(list)) != NULL) {
-		TAILQ_REMOVE(list, node, entry);
-		free(node);
+		if (qp->proc_ppid == 0 && tail < n)
+			bfs[tail++] = qp;
 	}
 
-	return (-1);
-}
-
-static int
-entry_leaders_build(struct quark_queue *qq)
-{
-	struct quark_process	*qp;
-	struct proc_node	*node;
-	struct proc_node_list	 list;
-
-	if ((qq->flags & QQ_ENTRY_LEADER) == 0)
-		return (0);
-
-	if (entry_leader_build_walklist(qq, &list) == -1)
-		return (-1);
-
-	while ((node = TAILQ_FIRST(&list)) != NULL) {
-		qp = process_cache_get(qq, node->pid, 0);
-		if (qp == NULL)
-			goto fail;
+	while (head < tail) {
+		qp = bfs[head++];
 		if (entry_leader_compute(qq, qp) == -1)
 			warnx("unknown entry_leader for pid %d", qp->pid);
-		TAILQ_REMOVE(&list, node, entry);
-		free(node);
+		LIST_FOREACH(child, &qp->children, entry_sibling) {
+			if (tail < n)
+				bfs[tail++] = child;
+		}
 	}
+	free(bfs);
 
 	return (0);
-
-fail:
-	while ((node = TAILQ_FIRST(&list)) != NULL) {
-		TAILQ_REMOVE(&list, node, entry);
-		free(node);
-	}
-
-	return (-1);
 }
 
 static const char *
@@ -769,14 +1330,23 @@ quark_event_dump(struct quark_event *qev, FILE *f)
 	const char			*flagname;
 	char				 events[1024];
 	const struct quark_process	*qp;
+	const struct quark_thread	*qt;
 
 	qp = qev->process;
 	if (qp == NULL)
 		return (-1);
 
-	/* TODO: add tid */
 	events_type_str(qev->events, events, sizeof(events));
 	P("->%d (%s)\n", qp->pid, events);
+	if ((qt = qev->thread) != NULL) {
+		P("  THRD\ttid=%d", qt->tid);
+		if (qt->flags & QUARK_F_COMM)
+			P(" comm=%s", qt->comm);
+		if (qt->flags & QUARK_F_EXIT)
+			P(" exit_code=%d exit_time=%llu", qt->exit_code,
+			    qt->exit_time_event);
+		P("\n");
+	}
 	if (qp->flags & QUARK_F_COMM) {
 		flagname = event_flag_str(QUARK_F_COMM);
 		P("  %.4s\tcomm=%s\n", flagname, qp->comm);
@@ -810,12 +1380,6 @@ quark_event_dump(struct quark_event *qev, FILE *f)
 		    flagname, qp->proc_uid, qp->proc_gid, qp->proc_suid,
 		    qp->proc_sgid, qp->proc_euid, qp->proc_egid,
 		    qp->proc_pgid, qp->proc_sid);
-		P("  %.4s\tcap_inheritable=0x%llx cap_permitted=0x%llx "
-		    "cap_effective=0x%llx\n",
-		    flagname, qp->proc_cap_inheritable,
-		    qp->proc_cap_permitted, qp->proc_cap_effective);
-		P("  %.4s\tcap_bset=0x%llx cap_ambient=0x%llx\n",
-		    flagname, qp->proc_cap_bset, qp->proc_cap_ambient);
 		P("  %.4s\ttime_boot=%llu tty_major=%d tty_minor=%d\n",
 		    flagname, qp->proc_time_boot,
 		    qp->proc_tty_major, qp->proc_tty_minor);
@@ -823,6 +1387,15 @@ quark_event_dump(struct quark_event *qev, FILE *f)
 		    entry_leader_type_str(qp->proc_entry_leader_type),
 		    qp->proc_entry_leader);
 	}
+	if (qp->flags & QUARK_F_CAPS) {
+		flagname = event_flag_str(QUARK_F_CAPS);
+		P("  %.4s\tcap_inheritable=0x%llx cap_permitted=0x%llx "
+		    "cap_effective=0x%llx\n",
+		    flagname, qp->proc_cap_inheritable,
+		    qp->proc_cap_permitted, qp->proc_cap_effective);
+		P("  %.4s\tcap_bset=0x%llx cap_ambient=0x%llx\n",
+		    flagname, qp->proc_cap_bset, qp->proc_cap_ambient);
+	}
 	if (qp->flags & QUARK_F_CWD) {
 		flagname = event_flag_str(QUARK_F_CWD);
 		P("  %.4s\tcwd=%s\n", flagname, qp->cwd);
@@ -850,11 +1423,53 @@ quark_process_lookup(struct quark_queue *qq, int pid)
 	return (process_cache_get(qq, pid, 0));
 }
 
+const char *
+quark_process_filename(const struct quark_process *qp)
+{
+	if ((qp->flags & QUARK_F_FILENAME) == 0)
+		return (NULL);
+
+	return (qp->filename);
+}
+
+const char *
+quark_process_cmdline(const struct quark_process *qp, size_t *cmdline_len)
+{
+	if ((qp->flags & QUARK_F_CMDLINE) == 0)
+		return (NULL);
+	if (cmdline_len != NULL)
+		*cmdline_len = qp->cmdline_len;
+
+	return (qp->cmdline);
+}
+
+const char *
+quark_process_cwd(const struct quark_process *qp)
+{
+	if ((qp->flags & QUARK_F_CWD) == 0)
+		return (NULL);
+
+	return (qp->cwd);
+}
+
 void
 quark_process_iter_init(struct quark_process_iter *qi, struct quark_queue *qq)
 {
 	qi->qq = qq;
 	qi->qp = RB_MIN(process_by_pid, &qq->process_by_pid);
+	qi->children = 0;
+}
+
+void
+quark_process_children_iter_init(struct quark_process_iter *qi,
+    struct quark_queue *qq, int pid)
+{
+	struct quark_process	*parent;
+
+	qi->qq = qq;
+	parent = process_cache_get(qq, pid, 0);
+	qi->qp = parent != NULL ? LIST_FIRST(&parent->children) : NULL;
+	qi->children = 1;
 }
 
 const struct quark_process *
@@ -863,12 +1478,135 @@ quark_process_iter_next(struct quark_process_iter *qi)
 	const struct quark_process	*qp;
 
 	qp = qi->qp;
-	if (qi->qp != NULL)
+	if (qi->qp == NULL)
+		return (NULL);
+	if (qi->children)
+		qi->qp = LIST_NEXT(qi->qp, entry_sibling);
+	else
 		qi->qp = RB_NEXT(process_by_pid, &qq->process_by_pid, qi->qp);
 
 	return (qp);
 }
 
+static void
+process_set_task(struct quark_queue *qq, struct quark_process *qp,
+    struct raw_task *raw_task)
+{
+	qp->flags |= QUARK_F_PROC;
+
+	if (qq->field_mask & QUARK_F_CAPS) {
+		qp->flags |= QUARK_F_CAPS;
+		qp->proc_cap_inheritable = raw_task->cap_inheritable;
+		qp->proc_cap_permitted = raw_task->cap_permitted;
+		qp->proc_cap_effective = raw_task->cap_effective;
+		qp->proc_cap_bset = raw_task->cap_bset;
+		qp->proc_cap_ambient = raw_task->cap_ambient;
+	}
+	qp->proc_time_boot = quark.boottime + raw_task->start_boottime;
+	qp->proc_ppid = raw_task->ppid;
+	qp->proc_uid = raw_task->uid;
+	qp->proc_gid = raw_task->gid;
+	qp->proc_suid = raw_task->suid;
+	qp->proc_sgid = raw_task->sgid;
+	qp->proc_euid = raw_task->euid;
+	qp->proc_egid = raw_task->egid;
+	qp->proc_pgid = raw_task->pgid;
+	qp->proc_sid = raw_task->sid;
+	qp->proc_tty_major = raw_task->tty_major;
+	qp->proc_tty_minor = raw_task->tty_minor;
+}
+
+/*
+ * Merge an exec event from a backend snapshot into the cache, no quark_event
+ * is generated and parents are linked by the caller once all processes are
+ * known, see quark_queue_open().
+ */
+int
+raw_event_snapshot(struct quark_queue *qq, struct raw_event *raw)
+{
+	struct quark_process	*qp;
+	struct raw_task		*raw_task;
+
+	if (raw->type != RAW_EXEC || !(raw->exec.flags & RAW_EXEC_F_EXT))
+		return (errno = EINVAL, -1);
+	if ((qp = process_cache_get(qq, raw->pid, 1)) == NULL)
+		return (-1);
+
+	raw_task = &raw->exec.ext.task;
+	process_set_task(qq, qp, raw_task);
+	qp->flags |= QUARK_F_COMM;
+	strlcpy(qp->comm, raw_task->comm, sizeof(qp->comm));
+	/* Kernel threads have no executable */
+	if (raw->exec.filename.p[0] != 0)
+		process_set_filename(qq, qp, raw->exec.filename.p);
+	process_set_cwd(qq, qp, raw_task->cwd.p);
+
+	return (0);
+}
+
+static void
+raw_event_thread_one(struct quark_thread *qt, struct raw_event *raw,
+    u64 *events)
+{
+	switch (raw->type) {
+	case RAW_WAKE_UP_NEW_TASK:
+		*events |= QUARK_EV_FORK;
+		qt->flags |= QUARK_F_COMM;
+		strlcpy(qt->comm, raw->task.comm, sizeof(qt->comm));
+		break;
+	case RAW_EXIT_THREAD:
+		*events |= QUARK_EV_EXIT;
+		qt->flags |= QUARK_F_EXIT;
+		qt->exit_code = raw->task.exit_code;
+		if (raw->task.exit_time_event)
+			qt->exit_time_event = quark.boottime +
+			    raw->task.exit_time_event;
+		break;
+	case RAW_COMM:
+		*events |= QUARK_EV_SETPROCTITLE;
+		qt->flags |= QUARK_F_COMM;
+		strlcpy(qt->comm, raw->comm.comm, sizeof(qt->comm));
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Events of a thread other than the leader, they go to the thread cache and
+ * leave the process alone, a thread exiting is not the process exiting.
+ */
+static int
+raw_event_thread(struct quark_queue *qq, struct raw_event *src,
+    struct quark_event *dst)
+{
+	struct quark_process	*qp;
+	struct quark_thread	*qt;
+	struct raw_event	*agg;
+	u64			 events;
+
+	if ((qp = process_cache_get(qq, src->pid, 1)) == NULL)
+		return (-1);
+	if ((qt = thread_cache_get(qq, src->tid, src->pid)) == NULL)
+		return (-1);
+
+	events = 0;
+	raw_event_thread_one(qt, src, &events);
+	TAILQ_FOREACH(agg, &src->agg_queue, agg_entry)
+		raw_event_thread_one(qt, agg, &events);
+
+	if ((qt->flags & QUARK_F_EXIT) && qt->gc_time == 0) {
+		qt->gc_time = now64();
+		TAILQ_INSERT_TAIL(&qq->thread_gc, qt, entry_gc);
+	}
+
+	dst->events = events;
+	dst->process = qp;
+	dst->thread = qt;
+
+	return (0);
+}
+
 static int
 raw_event_process(struct quark_queue *qq, struct raw_event *src, struct
     quark_event *dst)
@@ -896,6 +1634,11 @@ raw_event_process(struct quark_queue *qq, struct raw_event *src, struct
 	args = NULL;
 	args_len = 0;
 
+	if ((qq->flags & QQ_THREAD_EVENTS) && src->tid != 0 &&
+	    src->tid != src->pid && (src->type == RAW_WAKE_UP_NEW_TASK ||
+	    src->type == RAW_EXIT_THREAD || src->type == RAW_COMM))
+		return (raw_event_thread(qq, src, dst));
+
 	/* XXX pass if this is a fork down, so we can evict the old one XXX */
 	qp = process_cache_get(qq, src->pid, 1);
 	if (qp == NULL)
@@ -973,9 +1716,7 @@ raw_event_process(struct quark_queue *qq, struct raw_event *src, struct
 		/* NOTE: maybe there are more things we _don't_ want from exit */
 	}
 	if (raw_exec != NULL) {
-		qp->flags |= QUARK_F_FILENAME;
-
-		strlcpy(qp->filename, raw_exec->filename.p, sizeof(qp->filename));
+		process_set_filename(qq, qp, raw_exec->filename.p);
 		if (raw_exec->flags & RAW_EXEC_F_EXT) {
 			args = raw_exec->ext.args.p;
 			args_len = raw_exec->ext.args_len;
@@ -990,25 +1731,8 @@ raw_event_process(struct quark_queue *qq, struct raw_event *src, struct
 		cwd = raw_task->cwd.p;
 	}
 	if (raw_task != NULL) {
-		qp->flags |= QUARK_F_PROC;
-
-		qp->proc_cap_inheritable = raw_task->cap_inheritable;
-		qp->proc_cap_permitted = raw_task->cap_permitted;
-		qp->proc_cap_effective = raw_task->cap_effective;
-		qp->proc_cap_bset = raw_task->cap_bset;
-		qp->proc_cap_ambient = raw_task->cap_ambient;
-		qp->proc_time_boot = quark.boottime + raw_task->start_boottime;
-		qp->proc_ppid = raw_task->ppid;
-		qp->proc_uid = raw_task->uid;
-		qp->proc_gid = raw_task->gid;
-		qp->proc_suid = raw_task->suid;
-		qp->proc_sgid = raw_task->sgid;
-		qp->proc_euid = raw_task->euid;
-		qp->proc_egid = raw_task->egid;
-		qp->proc_pgid = raw_task->pgid;
-		qp->proc_sid = raw_task->sid;
-		qp->proc_tty_major = raw_task->tty_major;
-		qp->proc_tty_minor = raw_task->tty_minor;
+		process_set_task(qq, qp, raw_task);
+		process_link_parent(qq, qp);
 
 		/* Don't set cwd as it's not valid on exit */
 		comm = raw_task->comm;
@@ -1019,29 +1743,15 @@ raw_event_process(struct quark_queue *qq, struct raw_event *src, struct
 	 * Field pointer checking, stuff the block above sets so we save some
 	 * code.
 	 */
-	if (args != NULL) {
-		size_t		 copy_len;
-
-		qp->flags |= QUARK_F_CMDLINE;
-
-		qp->cmdline[0] = 0;
-		copy_len = min(sizeof(qp->cmdline), args_len);
-		if (copy_len > 0) {
-			memcpy(qp->cmdline, args, copy_len);
-			qp->cmdline[copy_len - 1] = 0;
-		}
-		qp->cmdline_len = copy_len;
-	}
+	if (args != NULL)
+		process_set_cmdline(qq, qp, args, args_len);
 	if (comm != NULL) {
 		qp->flags |= QUARK_F_COMM;
 
 		strlcpy(qp->comm, comm, sizeof(qp->comm));
 	}
-	if (cwd != NULL) {
-		qp->flags |= QUARK_F_CWD;
-
-		strlcpy(qp->cwd, cwd, sizeof(qp->cwd));
-	}
+	if (cwd != NULL)
+		process_set_cwd(qq, qp, cwd);
 
 	if (qp->flags == 0)
 		warnx("%s: no flags", __func__);
@@ -1062,212 +1772,295 @@ raw_event_process(struct quark_queue *qq, struct raw_event *src, struct
 		TAILQ_INSERT_TAIL(&qq->event_gc, qp, entry_gc);
 	}
 
-	dst->events = events;
-	dst->process = qp;
+	dst->events = events;
+	dst->process = qp;
+	dst->thread = NULL;
+
+	return (0);
+}
+
+/*
+ * /proc parsers, single pass over a buffer and only look at what we need, no
+ * stdio and no allocations.
+ */
+static int
+sproc_parse_u64(const char **pp, const char *end, int base, u64 *v)
+{
+	const char	*p, *start;
+	u64		 u, d;
+
+	for (start = *pp; start < end && (*start == ' ' || *start == '\t');)
+		start++;
+	for (u = 0, p = start; p < end; p++) {
+		if (*p >= '0' && *p <= '9')
+			d = *p - '0';
+		else if (base == 16 && *p >= 'a' && *p <= 'f')
+			d = *p - 'a' + 10;
+		else if (base == 16 && *p >= 'A' && *p <= 'F')
+			d = *p - 'A' + 10;
+		else
+			break;
+		if (u > (ULLONG_MAX - d) / base)
+			return (-1);
+		u = u * base + d;
+	}
+	if (p == start)
+		return (-1);
+	*pp = p;
+	*v = u;
+
+	return (0);
+}
+
+static int
+sproc_parse_u32(const char **pp, const char *end, u32 *v)
+{
+	u64	u;
+
+	if (sproc_parse_u64(pp, end, 10, &u) == -1 || u > UINT32_MAX)
+		return (-1);
+	*v = u;
+
+	return (0);
+}
+
+/*
+ * /proc/pid/status, lines of "Key:\tvalue\n"
+ */
+int
+sproc_parse_status(struct quark_process *qp, const char *buf, size_t len)
+{
+	const char	*p, *v, *eol, *end;
+	size_t		 klen;
+	int		 r;
+
+	end = buf + len;
+	for (p = buf; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if ((v = memchr(p, ':', eol - p)) == NULL) {
+			warnx("%s: no `:` found", __func__);
+			return (-1);
+		}
+		klen = v - p;
+		v++;
+		while (v < eol && (*v == ' ' || *v == '\t'))
+			v++;
+		if (v == eol)
+			continue;
+#define KEY(_k)	(klen == sizeof(_k) - 1 && !memcmp(p, _k, klen))
+		if (KEY("Pid"))
+			r = sproc_parse_u32(&v, eol, &qp->pid);
+		else if (KEY("PPid"))
+			r = sproc_parse_u32(&v, eol, &qp->proc_ppid);
+		else if (KEY("Uid"))
+			r = sproc_parse_u32(&v, eol, &qp->proc_uid) ||
+			    sproc_parse_u32(&v, eol, &qp->proc_euid) ||
+			    sproc_parse_u32(&v, eol, &qp->proc_suid);
+		else if (KEY("Gid"))
+			r = sproc_parse_u32(&v, eol, &qp->proc_gid) ||
+			    sproc_parse_u32(&v, eol, &qp->proc_egid) ||
+			    sproc_parse_u32(&v, eol, &qp->proc_sgid);
+		else if (KEY("CapInh"))
+			r = sproc_parse_u64(&v, eol, 16,
+			    &qp->proc_cap_inheritable);
+		else if (KEY("CapPrm"))
+			r = sproc_parse_u64(&v, eol, 16,
+			    &qp->proc_cap_permitted);
+		else if (KEY("CapEff"))
+			r = sproc_parse_u64(&v, eol, 16,
+			    &qp->proc_cap_effective);
+		else if (KEY("CapBnd"))
+			r = sproc_parse_u64(&v, eol, 16, &qp->proc_cap_bset);
+		else if (KEY("CapAmb"))
+			r = sproc_parse_u64(&v, eol, 16, &qp->proc_cap_ambient);
+		else
+			r = 0;
+#undef KEY
+		if (r != 0) {
+			warnx("%s: can't handle %.*s", __func__, (int)klen, p);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * /proc/pid/stat, see proc(5), starttime is returned in clock ticks.
+ */
+int
+sproc_parse_stat(struct quark_process *qp, const char *buf, size_t len,
+    u64 *starttime)
+{
+	const char	*p, *end;
+	int		 field, found;
+	u32		 pgid, sid, tty;
+
+	/*
+	 * comm might have spaces, newlines and whatnot, procfs is nice enough
+	 * to put parenthesis around them.
+	 */
+	end = buf + len;
+	if ((p = memrchr(buf, ')', len)) == NULL)
+		return (-1);
+	p++;
+	found = 0;
+	pgid = sid = tty = 0;
+	/* (3) state is the first field after comm */
+	for (field = 3; p < end && found != 4; field++) {
+		while (p < end && *p == ' ')
+			p++;
+		switch (field) {
+		case 5:		/* pgrp */
+			found += sproc_parse_u32(&p, end, &pgid) == 0;
+			break;
+		case 6:		/* session */
+			found += sproc_parse_u32(&p, end, &sid) == 0;
+			break;
+		case 7:		/* tty_nr */
+			found += sproc_parse_u32(&p, end, &tty) == 0;
+			break;
+		case 22:	/* starttime */
+			found += sproc_parse_u64(&p, end, 10, starttime) == 0;
+			break;
+		default:
+			break;
+		}
+		while (p < end && *p != ' ')
+			p++;
+	}
+	if (found != 4)
+		return (-1);
+
+	qp->proc_pgid = pgid;
+	qp->proc_sid = sid;
+	/* See proc(5) */
+	qp->proc_tty_major = (tty >> 8) & 0xff;
+	qp->proc_tty_minor = ((tty >> 12) & 0xfff00) | (tty & 0xff);
 
 	return (0);
 }
 
 static int
-sproc_status_line(struct quark_process *qp, const char *k, const char *v)
+sproc_stat(struct quark_process *qp, int dfd, struct qbuf *qb)
 {
-	const char		*errstr;
-
-	if (*v == 0)
-		return (0);
+	ssize_t	n;
+	u64	starttime;
 
-	if (!strcmp(k, "Pid")) {
-		qp->pid = strtonum(v, 0, UINT32_MAX, &errstr);
-		if (errstr != NULL)
-			return (-1);
-	} else if (!strcmp(k, "PPid")) {
-		qp->proc_ppid = strtonum(v, 0, UINT32_MAX, &errstr);
-		if (errstr != NULL)
-			return (-1);
-	} else if (!strcmp(k, "Uid")) {
-		if (sscanf(v, "%d %d %d\n",
-		    &qp->proc_uid, &qp->proc_euid, &qp->proc_suid) != 3)
-			return (-1);
-	} else if (!strcmp(k, "Gid")) {
-		if (sscanf(v, "%d %d %d\n",
-		    &qp->proc_gid, &qp->proc_egid, &qp->proc_sgid) != 3)
-			return (-1);
-	} else if (!strcmp(k, "CapInh")) {
-		if (strtou64(&qp->proc_cap_inheritable, v, 16) == -1)
-			return (-1);
-	} else if (!strcmp(k, "CapPrm")) {
-		if (strtou64(&qp->proc_cap_permitted, v, 16) == -1)
-			return (-1);
-	} else if (!strcmp(k, "CapEff")) {
-		if (strtou64(&qp->proc_cap_effective, v, 16) == -1)
-			return (-1);
-	} else if (!strcmp(k, "CapBnd")) {
-		if (strtou64(&qp->proc_cap_bset, v, 16) == -1)
-			return (-1);
-	} else if (!strcmp(k, "CapAmb")) {
-		if (strtou64(&qp->proc_cap_ambient, v, 16) == -1)
-			return (-1);
+	if ((n = qbuf_readat(qb, dfd, "stat")) == -1) {
+		warn("%s: read stat", __func__);
+		return (-1);
 	}
+	if (sproc_parse_stat(qp, qb->p + qb->len, n, &starttime) == -1)
+		return (-1);
+	qp->proc_time_boot =
+	    quark.boottime + ((starttime / (u64)quark.hz) * NS_PER_S);
 
 	return (0);
 }
 
 static int
-sproc_stat(struct quark_process *qp, int dfd)
+sproc_status(struct quark_process *qp, int dfd, struct qbuf *qb)
 {
-	int			 fd, r, ret;
-	char			*buf, *p;
-	u32			 pgid, sid, tty;
-	unsigned long long	 starttime;
-
-	buf = NULL;
-	ret = -1;
+	ssize_t	n;
 
-	if ((fd = openat(dfd, "stat", O_RDONLY)) == -1) {
-		warn("%s: open stat", __func__);
+	if ((n = qbuf_readat(qb, dfd, "status")) == -1) {
+		warn("%s: read status", __func__);
 		return (-1);
 	}
-	buf = load_file_nostat(fd, NULL);
-	if (buf == NULL)
-		goto cleanup;
-
-	/*
-	 * comm might have spaces, newlines and whatnot, procfs is nice enough
-	 * to put parenthesis around them.
-	 */
-	p = strrchr(buf, ')');
-	if (p == NULL)
-		goto cleanup;
-	p++;			/* Skip over ") " */
-	while (isspace(*p))
-		p++;
-	starttime = 0;
-	r = sscanf(p,
-	    "%*s "		/* (3) state */
-	    "%*s "		/* (4) ppid */
-	    "%d "		/* (5) pgrp */
-	    "%d "		/* (6) session */
-	    "%d "		/* (7) tty_nr */
-	    "%*s "		/* (8) tpgid */
-	    "%*s "		/* (9) flags */
-	    "%*s "		/* (10) minflt */
-	    "%*s "		/* (11) cminflt */
-	    "%*s "		/* (12) majflt */
-	    "%*s "		/* (13) cmajflt */
-	    "%*s "		/* (14) utime */
-	    "%*s "		/* (15) stime */
-	    "%*s "		/* (16) cutime */
-	    "%*s "		/* (17) cstime */
-	    "%*s "		/* (18) priority */
-	    "%*s "		/* (19) nice */
-	    "%*s "		/* (20) num_threads */
-	    "%*s "		/* (21) itrealvalue */
-	    "%llu ",		/* (22) starttime */
-				/* ... */
-	    &pgid,
-	    &sid,
-	    &tty,
-	    &starttime);
-
-	if (r == 4) {
-		qp->proc_pgid = pgid;
-		qp->proc_sid = sid;
-		/* See proc(5) */
-		qp->proc_tty_major = (tty >> 8) & 0xff;
-		qp->proc_tty_minor = ((tty >> 12) & 0xfff00) | (tty & 0xff);
-		qp->proc_time_boot =
-		    quark.boottime +
-		    (((u64)starttime / (u64)quark.hz) * NS_PER_S);
-
-		ret = 0;
-	}
-
-cleanup:
-	free(buf);
-	close(fd);
 
-	return (ret);
+	return (sproc_parse_status(qp, qb->p + qb->len, n));
 }
 
+/*
+ * A scraped pid is first staged, this doesn't touch the queue so it can be
+ * done by multiple workers in parallel, only merging into the cache is done
+ * by the caller of quark_queue_open(). Strings are kept in the qbuf of the
+ * worker and referenced by offset, as the qbuf might move when growing.
+ */
+struct sproc_stage {
+	struct quark_process	 qp;
+	int			 valid;
+	struct qbuf		*qb;
+	size_t			 filename;
+	size_t			 cwd;
+	size_t			 cmdline;
+	size_t			 cmdline_len;
+};
+
+struct sproc_work {
+	int			 rootfd;
+	u32			*pids;
+	struct sproc_stage	*stages;
+	size_t			 npids;
+	size_t			*next;
+	struct qbuf		 qb;
+};
+
 static int
-sproc_status(struct quark_process *qp, int dfd)
+sproc_readlink(struct qbuf *qb, int dfd, const char *pathname, size_t *off)
 {
-	int			 fd, ret;
-	FILE			*f;
-	ssize_t			 n;
-	size_t			 line_len;
-	char			*line, *k, *v;
+	size_t	len;
 
-	if ((fd = openat(dfd, "status", O_RDONLY)) == -1) {
-		warn("%s: open status", __func__);
+	if (qbuf_reserve(qb, PATH_MAX) == -1 ||
+	    qreadlinkat(dfd, pathname, qb->p + qb->len, PATH_MAX) <= 0)
 		return (-1);
-	}
-	f = fdopen(fd, "r");
-	if (f == NULL)
+	len = strlen(qb->p + qb->len);
+	if (len == 0)
 		return (-1);
+	*off = qb->len;
+	qb->len += len + 1;
 
-	ret = 0;
-	line_len = 0;
-	line = NULL;
-	while ((n = getline(&line, &line_len, f)) != -1) {
-		/* k:\tv\n = 5 */
-		if (n < 5 || line[n - 1] != '\n') {
-			warnx("%s: bad line", __func__);
-			ret = -1;
-			break;
-		}
-		line[n - 1] = 0;
-		k = line;
-		v = strstr(line, ":\t");
-		if (v == NULL) {
-			warnx("%s: no `:\\t` found", __func__);
-			ret = -1;
-			break;
-		}
-		*v = 0;
-		v += 2;
-		if (sproc_status_line(qp, k, v) == -1) {
-			warnx("%s: can't handle %s", __func__, k);
-			ret = -1;
-			break;
-		}
-	}
-	free(line);
-	fclose(f);
-
-	return (ret);
-
+	return (0);
 }
 
 static int
-sproc_cmdline(struct quark_process *qp, int dfd)
+sproc_pid_stage(struct sproc_stage *st, int rootfd, u32 pid, struct qbuf *qb)
 {
-	int	 fd;
-	char	*buf;
-	size_t	 buf_len, copy_len;
+	struct quark_process	*qp = &st->qp;
+	int			 dfd;
+	ssize_t			 n;
+	char			 name[16];
 
-	if ((fd = openat(dfd, "cmdline", O_RDONLY)) == -1) {
-		warn("%s: open cmdline", __func__);
+	(void)snprintf(name, sizeof(name), "%u", pid);
+	if ((dfd = openat(rootfd, name, O_PATH)) == -1) {
+		warn("openat %s", name);
 		return (-1);
 	}
-	buf = load_file_nostat(fd, &buf_len);
-	close(fd);
-	if (buf == NULL)
-		return (-1);
-	copy_len = min(sizeof(qp->cmdline), buf_len);
-	memcpy(qp->cmdline, buf, copy_len);
-	free(buf);
-	/* paranoia */
-	qp->cmdline[copy_len - 1] = 0;
-	qp->cmdline_len = copy_len;
+	st->valid = 1;
+	st->qb = qb;
+
+	if (sproc_status(qp, dfd, qb) == 0 && sproc_stat(qp, dfd, qb) == 0)
+		qp->flags |= QUARK_F_PROC;
+
+	/* QUARK_F_COMM */
+	if (readlineat(dfd, "comm", qp->comm, sizeof(qp->comm)) > 0)
+		qp->flags |= QUARK_F_COMM;
+	/* QUARK_F_FILENAME */
+	if (sproc_readlink(qb, dfd, "exe", &st->filename) == 0)
+		qp->flags |= QUARK_F_FILENAME;
+	/* QUARK_F_CMDLINE, empty for kthreads */
+	if ((n = qbuf_readat(qb, dfd, "cmdline")) > 0) {
+		st->cmdline = qb->len;
+		st->cmdline_len = n;
+		qb->len += n + 1;
+		qp->flags |= QUARK_F_CMDLINE;
+	}
+	/* QUARK_F_CWD */
+	if (sproc_readlink(qb, dfd, "cwd", &st->cwd) == 0)
+		qp->flags |= QUARK_F_CWD;
+
+	close(dfd);
 
 	return (0);
 }
 
 static int
-sproc_pid(struct quark_queue *qq, int pid, int dfd)
+sproc_pid_merge(struct quark_queue *qq, u32 pid, struct sproc_stage *st)
 {
 	struct quark_process	*qp;
+	const char		*base;
 
 	/*
 	 * This allocates and inserts it into the cache in case it's not already
@@ -1278,32 +2071,117 @@ sproc_pid(struct quark_queue *qq, int pid, int dfd)
 	if (qp == NULL)
 		return (-1);
 
-	if (sproc_status(qp, dfd) == 0 && sproc_stat(qp, dfd) == 0)
+	if (st->qp.flags & QUARK_F_PROC) {
+#define CPY(_f)	qp->_f = st->qp._f
+		if (qq->field_mask & QUARK_F_CAPS) {
+			CPY(proc_cap_inheritable);
+			CPY(proc_cap_permitted);
+			CPY(proc_cap_effective);
+			CPY(proc_cap_bset);
+			CPY(proc_cap_ambient);
+			qp->flags |= QUARK_F_CAPS;
+		}
+		CPY(proc_time_boot);
+		CPY(proc_ppid);
+		CPY(proc_uid);
+		CPY(proc_gid);
+		CPY(proc_suid);
+		CPY(proc_sgid);
+		CPY(proc_euid);
+		CPY(proc_egid);
+		CPY(proc_pgid);
+		CPY(proc_sid);
+		CPY(proc_tty_major);
+		CPY(proc_tty_minor);
+#undef CPY
 		qp->flags |= QUARK_F_PROC;
-
-	/* QUARK_F_COMM */
-	if (readlineat(dfd, "comm", qp->comm, sizeof(qp->comm)) > 0)
+	}
+	if (st->qp.flags & QUARK_F_COMM) {
+		strlcpy(qp->comm, st->qp.comm, sizeof(qp->comm));
 		qp->flags |= QUARK_F_COMM;
-	/* QUARK_F_FILENAME */
-	if (qreadlinkat(dfd, "exe", qp->filename, sizeof(qp->filename)) > 0)
-		qp->flags |= QUARK_F_FILENAME;
-	/* QUARK_F_CMDLINE */
-	if (sproc_cmdline(qp, dfd) == 0)
-		qp->flags |= QUARK_F_CMDLINE;
-	/* QUARK_F_CWD */
-	if (qreadlinkat(dfd, "cwd", qp->cwd, sizeof(qp->cwd)) > 0)
-		qp->flags |= QUARK_F_CWD;
+	}
+	base = st->qb->p;
+	if (st->qp.flags & QUARK_F_FILENAME)
+		process_set_filename(qq, qp, base + st->filename);
+	if (st->qp.flags & QUARK_F_CMDLINE)
+		process_set_cmdline(qq, qp, base + st->cmdline,
+		    st->cmdline_len);
+	if (st->qp.flags & QUARK_F_CWD)
+		process_set_cwd(qq, qp, base + st->cwd);
 
 	return (0);
 }
 
+static void *
+sproc_worker(void *arg)
+{
+	struct sproc_work	*w = arg;
+	size_t			 i;
+
+	while ((i = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) <
+	    w->npids)
+		sproc_pid_stage(&w->stages[i], w->rootfd, w->pids[i], &w->qb);
+
+	return (NULL);
+}
+
+/*
+ * Stage all pids with nthreads workers, the calling thread is one of them.
+ * Each worker has its own qbuf, they are freed by the caller after merging.
+ */
+static struct sproc_work *
+sproc_stage_parallel(int rootfd, u32 *pids, struct sproc_stage *stages,
+    size_t npids, int nthreads)
+{
+	pthread_t		*threads;
+	struct sproc_work	*works;
+	size_t			*next;
+	int			 i, started;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	works = calloc(nthreads, sizeof(*works));
+	next = calloc(1, sizeof(*next));
+	if (threads == NULL || works == NULL || next == NULL) {
+		free(threads);
+		free(works);
+		free(next);
+		return (NULL);
+	}
+	for (i = 0; i < nthreads; i++) {
+		works[i].rootfd = rootfd;
+		works[i].pids = pids;
+		works[i].stages = stages;
+		works[i].npids = npids;
+		works[i].next = next;
+	}
+	for (started = 0; started < nthreads - 1; started++) {
+		if (pthread_create(&threads[started], NULL, sproc_worker,
+		    &works[started + 1]) != 0) {
+			warnx("%s: pthread_create", __func__);
+			break;
+		}
+	}
+	sproc_worker(&works[0]);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(next);
+
+	return (works);
+}
+
 static int
-sproc_scrape(struct quark_queue *qq)
+sproc_scrape(struct quark_queue *qq, int nthreads)
 {
-	FTS	*tree;
-	FTSENT	*f, *p;
-	int	 dfd, rootfd;
-	char	*argv[] = { "/proc", NULL };
+	FTS			*tree;
+	FTSENT			*f, *p;
+	int			 rootfd, i, ret;
+	char			*argv[] = { "/proc", NULL };
+	struct sproc_stage	 st, *stages;
+	struct sproc_work	*works;
+	struct qbuf		 qb;
+	u32			*pids, *tmp;
+	size_t			 npids, maxpids, n;
 
 	if ((tree = fts_open(argv, FTS_NOCHDIR, NULL)) == NULL)
 		return (-1);
@@ -1312,6 +2190,9 @@ sproc_scrape(struct quark_queue *qq)
 		return (-1);
 	}
 
+	ret = -1;
+	pids = NULL;
+	npids = maxpids = 0;
 	while ((f = fts_read(tree)) != NULL) {
 		if (f->fts_info == FTS_ERR || f->fts_info == FTS_NS)
 			warnx("%s: %s", f->fts_name, strerror(f->fts_errno));
@@ -1335,26 +2216,104 @@ sproc_scrape(struct quark_queue *qq)
 			if (p->fts_info != FTS_D || !isnumber(p->fts_name))
 				continue;
 
-			if ((dfd = openat(rootfd, p->fts_name, O_PATH)) == -1) {
-				warn("openat %s", p->fts_name);
-				continue;
-			}
 			pid = strtonum(p->fts_name, 1, UINT32_MAX, &errstr);
 			if (errstr != NULL) {
 				warnx("bad pid %s: %s", p->fts_name, errstr);
-				goto next;
+				continue;
 			}
-			if (sproc_pid(qq, pid, dfd) == -1)
-				warnx("can't scrape %s\n", p->fts_name);
-next:
-			close(dfd);
+			if (npids == maxpids) {
+				maxpids = maxpids == 0 ? 1024 : maxpids * 2;
+				tmp = reallocarray(pids, maxpids, sizeof(*pids));
+				/* A partial snapshot is worse than none */
+				if (tmp == NULL)
+					goto done;
+				pids = tmp;
+			}
+			pids[npids++] = pid;
+		}
+	}
+
+	if (nthreads > (int)npids)
+		nthreads = npids;
+	stages = NULL;
+	works = NULL;
+	if (nthreads > 1) {
+		stages = calloc(npids, sizeof(*stages));
+		if (stages != NULL)
+			works = sproc_stage_parallel(rootfd, pids, stages,
+			    npids, nthreads);
+		if (works == NULL) {
+			warn("%s: can't stage, scraping serially", __func__);
+			free(stages);
+			stages = NULL;
 		}
 	}
 
+	/*
+	 * Serially, the one qbuf is reused for every pid, so the steady state
+	 * does no allocations.
+	 */
+	bzero(&qb, sizeof(qb));
+	for (n = 0; n < npids; n++) {
+		if (stages == NULL) {
+			bzero(&st, sizeof(st));
+			qb.len = 0;
+			sproc_pid_stage(&st, rootfd, pids[n], &qb);
+		} else
+			st = stages[n];
+		if (st.valid && sproc_pid_merge(qq, pids[n], &st) == -1)
+			warnx("can't scrape %u", pids[n]);
+	}
+	qbuf_free(&qb);
+	if (works != NULL) {
+		for (i = 0; i < nthreads; i++)
+			qbuf_free(&works[i].qb);
+		free(works);
+	}
+	free(stages);
+	ret = 0;
+
+done:
+	free(pids);
 	close(rootfd);
 	fts_close(tree);
+	/* The only way out without a snapshot is growing pids */
+	if (ret == -1)
+		errno = ENOMEM;
 
-	return (0);
+	return (ret);
+}
+
+/*
+ * Backend snapshots can't read the arguments of other tasks, fetch them from
+ * /proc for whoever is missing them.
+ */
+static void
+sproc_cmdlines(struct quark_queue *qq)
+{
+	struct quark_process	*qp;
+	struct qbuf		 qb;
+	int			 rootfd;
+	ssize_t			 n;
+	char			 path[32];
+
+	if ((qq->field_mask & QUARK_F_CMDLINE) == 0)
+		return;
+	if ((rootfd = open("/proc", O_PATH)) == -1) {
+		warn("%s: open /proc", __func__);
+		return;
+	}
+	bzero(&qb, sizeof(qb));
+	RB_FOREACH(qp, process_by_pid, &qq->process_by_pid) {
+		if (qp->flags & QUARK_F_CMDLINE)
+			continue;
+		snprintf(path, sizeof(path), "%u/cmdline", qp->pid);
+		qb.len = 0;
+		if ((n = qbuf_readat(&qb, rootfd, path)) > 0)
+			process_set_cmdline(qq, qp, qb.p, n);
+	}
+	qbuf_free(&qb);
+	close(rootfd);
 }
 
 static u64
@@ -1504,6 +2463,19 @@ quark_dump_raw_event_graph(struct quark_queue *qq, FILE *by_time, FILE *by_pidti
 
 	P(f, "digraph {\n");
 	P(f, "node [style=filled, color=black];\n");
+	if (qq->flags & QQ_HOLD_HEAP) {
+		struct raw_event_heap	*h = &qq->raw_event_heap;
+		u32			 i;
+
+		for (i = 0; i < h->len; i++) {
+			snprintf(key, sizeof(key), "%llu", h->v[i]->time);
+			if (write_raw_node_attr(f, h->v[i], key) < 0)
+				return (-1);
+		}
+		for (i = 1; i < h->len; i++)
+			P(f, "%llu -> %llu;\n",
+			    h->v[HEAP_PARENT(i)]->time, h->v[i]->time);
+	}
 	RB_FOREACH(raw, raw_event_by_time, &qq->raw_event_by_time) {
 		snprintf(key, sizeof(key), "%llu", raw->time);
 		if (write_raw_node_attr(f, raw, key) < 0)
@@ -1665,22 +2637,174 @@ void
 quark_queue_get_stats(struct quark_queue *qq, struct quark_queue_stats *qs)
 {
 	qq->queue_ops->update_stats(qq);
+	qq->stats.hold_target = raw_event_target_age(qq);
 	*qs = qq->stats;
 }
 
+void
+quark_queue_get_histograms(struct quark_queue *qq,
+    struct quark_queue_histograms *qh)
+{
+	*qh = qq->histos;
+}
+
+/*
+ * Copy out up to n entries, returns how many cpus there are so the caller can
+ * size the array, or -1 if the backend doesn't track them.
+ */
+int
+quark_queue_get_cpu_stats(struct quark_queue *qq, struct quark_cpu_stats *qcs,
+    int n)
+{
+	if (qq->cpu_stats == NULL)
+		return (errno = ENOTSUP, -1);
+	if (n < 0)
+		return (errno = EINVAL, -1);
+	if (qq->queue_ops->update_stats(qq) == -1)
+		return (-1);
+	if (qcs != NULL)
+		memcpy(qcs, qq->cpu_stats,
+		    min(n, qq->num_cpus) * sizeof(*qcs));
+
+	return (qq->num_cpus);
+}
+
+/*
+ * When there will be something for quark_queue_get_events() to do without the
+ * rings waking us up: the oldest held event expires, an exited process leaves
+ * the cache, or a ring might be sitting on events below its wakeup threshold.
+ * Zero if nothing is pending.
+ */
+static u64
+quark_queue_deadline(struct quark_queue *qq, u64 now)
+{
+	struct raw_event	*raw;
+	struct quark_process	*qp;
+	struct quark_thread	*qt;
+	u64			 deadline;
+
+	if (qq->snap_pid != -1)
+		return (now);
+
+	deadline = 0;
+#define DEADLINE(_t)	(deadline = deadline == 0 ? (_t) : min(deadline, (_t)))
+	if ((raw = raw_event_min(qq)) != NULL) {
+		DEADLINE(raw->time + raw_event_target_age(qq));
+		/*
+		 * The next populate should move the watermark past it, if it
+		 * didn't, a ring is behind and we'd spin.
+		 */
+		if ((qq->flags & QQ_WATERMARK) &&
+		    raw->time + qq->agg_window > now)
+			DEADLINE(raw->time + qq->agg_window);
+	}
+	if ((qp = TAILQ_FIRST(&qq->event_gc)) != NULL)
+		DEADLINE(qp->gc_time + qq->cache_grace_time);
+	if ((qt = TAILQ_FIRST(&qq->thread_gc)) != NULL)
+		DEADLINE(qt->gc_time + qq->cache_grace_time);
+	/* Even when idle, a ring below its threshold can't wake us up */
+	if (qq->ring_tick)
+		DEADLINE(qq->populate_time + qq->ring_tick);
+#undef DEADLINE
+
+	return (deadline);
+}
+
+/*
+ * Re-arm qq->timerfd at the next deadline, it lives in the epoll set so
+ * quark_queue_block() and users polling quark_queue_get_epollfd() wake up
+ * exactly when there is work instead of on a fixed timeout.
+ */
+static void
+quark_queue_timer_arm(struct quark_queue *qq, u64 now)
+{
+	struct itimerspec	its;
+	u64			deadline, expirations;
+
+	if (qq->timerfd == -1)
+		return;
+	deadline = quark_queue_deadline(qq, now);
+	/* Still pending and hasn't fired, nothing to do */
+	if (deadline == qq->timer_deadline && deadline > now)
+		return;
+	/* Clear a previous expiration, or the descriptor stays readable */
+	if (qq->timer_deadline != 0 && qq->timer_deadline <= now)
+		(void)read(qq->timerfd, &expirations, sizeof(expirations));
+	qq->timer_deadline = deadline;
+	bzero(&its, sizeof(its));
+	if (deadline != 0) {
+		/* Zero would disarm it */
+		deadline = max(deadline, 1ULL);
+		its.it_value.tv_sec = deadline / NS_PER_S;
+		its.it_value.tv_nsec = deadline % NS_PER_S;
+	}
+	if (timerfd_settime(qq->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		warn("timerfd_settime");
+}
+
+static int
+quark_queue_timer_open(struct quark_queue *qq)
+{
+	struct epoll_event	ev;
+
+	/* Nothing to block on, nothing to wake up */
+	if (qq->epollfd == -1)
+		return (0);
+	qq->timerfd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC);
+	if (qq->timerfd == -1) {
+		warn("timerfd_create");
+		return (-1);
+	}
+	/*
+	 * Backends tell their rings apart by data, the queue itself is the
+	 * timer, see kprobe_queue_populate_batch(). The EBPF epoll set belongs
+	 * to libbpf, it's fine as we never call ring_buffer__poll().
+	 */
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = qq;
+	if (epoll_ctl(qq->epollfd, EPOLL_CTL_ADD, qq->timerfd, &ev) == -1) {
+		warn("epoll_ctl");
+		return (-1);
+	}
+	quark_queue_timer_arm(qq, now64());
+
+	return (0);
+}
+
 int
-quark_queue_block(struct quark_queue *qq)
+quark_queue_block(struct quark_queue *qq, int timeout)
 {
 	struct epoll_event	 ev;
+	int			 n;
 
 	if (qq->epollfd == -1)
 		return (errno = EINVAL, -1);
-	if (epoll_wait(qq->epollfd, &ev, 1, 100) == -1)
+	if ((n = epoll_wait(qq->epollfd, &ev, 1, timeout)) == -1)
 		return (-1);
+	if (n > 0)
+		quark_queue_block_done(qq, ev.data.u64);
 
 	return (0);
 }
 
+/*
+ * For callers doing their own epoll_wait(2), data is what it returned, the
+ * timer was registered with the queue itself, anything else is a ring.
+ */
+void
+quark_queue_block_done(struct quark_queue *qq, u64 data)
+{
+	u64	expirations;
+
+	if (data == (u64)(uintptr_t)qq) {
+		/* Don't spin if the caller only populates */
+		(void)read(qq->timerfd, &expirations, sizeof(expirations));
+	} else
+		qq->stats.wakeups++;
+}
+
 void
 quark_queue_default_attr(struct quark_queue_attr *qa)
 {
@@ -1690,6 +2814,13 @@ quark_queue_default_attr(struct quark_queue_attr *qa)
 	qa->max_length = 10000;
 	qa->cache_grace_time = 4000;	/* four seconds */
 	qa->hold_time = 1000;		/* one second */
+	qa->agg_window = 10;		/* ten milliseconds */
+	qa->scrape_threads = 1;
+	qa->hold_percentile = 0;	/* fixed hold_time */
+	qa->ring_pages = 16;		/* 64KB with 4KB pages */
+	qa->ring_wakeup = 10;		/* wake us up at 10% */
+	qa->ringbuf_size = 1 << 22;	/* 4MB */
+	qa->field_mask = QUARK_F_ALL;
 }
 
 int
@@ -1697,17 +2828,36 @@ quark_queue_open(struct quark_queue *qq, struct quark_queue_attr *qa)
 {
 	struct quark_process		*qp;
 	struct quark_queue_attr		 qa_default;
+	int				 snapped, i;
 
-	if (qa == NULL) {
-		quark_queue_default_attr(&qa_default);
+	/* Optional attributes left at zero get the default */
+	quark_queue_default_attr(&qa_default);
+	if (qa == NULL)
 		qa = &qa_default;
-	}
 
 	if ((qa->flags & QQ_ALL_BACKENDS) == 0 ||
 	    qa->max_length <= 0 ||
 	    qa->cache_grace_time < 0 ||
-	    qa->hold_time < 10)
+	    qa->hold_time < 10 ||
+	    ((qa->flags & QQ_WATERMARK) &&
+	    (qa->agg_window < 1 || qa->agg_window > qa->hold_time)) ||
+	    qa->scrape_threads < 0 ||
+	    qa->hold_percentile < 0 || qa->hold_percentile > 100 ||
+	    qa->ring_pages < 0 || (qa->ring_pages & (qa->ring_pages - 1)) ||
+	    qa->ring_wakeup < 0 || qa->ring_wakeup > 100 ||
+	    qa->ringbuf_size < 0 ||
+	    (qa->ringbuf_size != 0 && qa->ringbuf_size < getpagesize()) ||
+	    (qa->ringbuf_size & (qa->ringbuf_size - 1)) ||
+	    ((qa->flags & QQ_RINGBUF_PERCPU) &&
+	    (qa->flags & QQ_RINGBUF_PERNODE)) ||
+	    qa->nfilters < 0 || (qa->nfilters > 0 && qa->filters == NULL) ||
+	    (qa->field_mask & ~(u64)QUARK_F_ALL))
 		return (errno = EINVAL, -1);
+	for (i = 0; i < qa->nfilters; i++) {
+		if (qa->filters[i].type < QUARK_FILTER_PID ||
+		    qa->filters[i].type > QUARK_FILTER_CGROUP)
+			return (errno = EINVAL, -1);
+	}
 
 	if (quark_init() == -1)
 		return (-1);
@@ -1717,13 +2867,41 @@ quark_queue_open(struct quark_queue *qq, struct quark_queue_attr *qa)
 	RB_INIT(&qq->raw_event_by_time);
 	RB_INIT(&qq->raw_event_by_pidtime);
 	RB_INIT(&qq->process_by_pid);
+	RB_INIT(&qq->thread_by_tid);
+	RB_INIT(&qq->istr_by_value);
 	TAILQ_INIT(&qq->event_gc);
+	TAILQ_INIT(&qq->thread_gc);
+	raw_event_slab_init(qq);
 	qq->flags = qa->flags;
 	qq->max_length = qa->max_length;
 	qq->cache_grace_time = MS_TO_NS(qa->cache_grace_time);
 	qq->hold_time = qa->hold_time;
+	qq->agg_window = MS_TO_NS(qa->agg_window);
+	qq->hold_percentile = qa->hold_percentile;
+	qq->ring_pages = qa->ring_pages ? qa->ring_pages :
+	    qa_default.ring_pages;
+	qq->ring_wakeup = qa->ring_wakeup ? qa->ring_wakeup :
+	    qa_default.ring_wakeup;
+	qq->ringbuf_size = qa->ringbuf_size ? qa->ringbuf_size :
+	    qa_default.ringbuf_size;
+	/* These are always collected, they're cheap */
+	qq->field_mask = qa->field_mask ? qa->field_mask :
+	    qa_default.field_mask;
+	qq->field_mask |= QUARK_F_PROC | QUARK_F_EXIT | QUARK_F_COMM |
+	    QUARK_F_FILENAME;
+	if (qa->nfilters > 0) {
+		qq->filters = reallocarray(NULL, qa->nfilters,
+		    sizeof(*qq->filters));
+		if (qq->filters == NULL)
+			goto fail;
+		memcpy(qq->filters, qa->filters,
+		    qa->nfilters * sizeof(*qq->filters));
+		qq->nfilters = qa->nfilters;
+	}
+	qq->hold_target = MS_TO_NS(qa->hold_time);
 	qq->length = 0;
 	qq->epollfd = -1;
+	qq->timerfd = -1;
 	if (qq->flags & QQ_MIN_AGG)
 		qq->agg_matrix = agg_matrix_min;
 	else
@@ -1737,13 +2915,27 @@ quark_queue_open(struct quark_queue *qq, struct quark_queue_attr *qa)
 	/*
 	 * Now that the rings are opened, we can scrape proc. If we would scrape
 	 * before opening them, there would be a small window where we could
-	 * lose new processes.
+	 * lose new processes. A backend snapshot is preferred if asked for,
+	 * and we fall back to scraping if it fails.
 	 */
-	if (sproc_scrape(qq) == -1) {
+	snapped = 0;
+	if ((qq->flags & QQ_BPF_SNAPSHOT) &&
+	    qq->queue_ops->snapshot != NULL) {
+		if (qq->queue_ops->snapshot(qq) == 0) {
+			sproc_cmdlines(qq);
+			snapped = 1;
+		} else
+			warn("backend snapshot failed, scraping /proc");
+	}
+	if (!snapped && sproc_scrape(qq, qa->scrape_threads) == -1) {
 		warnx("can't scrape /proc");
 		goto fail;
 	}
 
+	/* Parents might have been seen after their children */
+	RB_FOREACH(qp, process_by_pid, &qq->process_by_pid)
+		process_link_parent(qq, qp);
+
 	/*
 	 * Compute all entry leaders
 	 */
@@ -1768,6 +2960,9 @@ quark_queue_open(struct quark_queue *qq, struct quark_queue_attr *qa)
 			qq->snap_pid = -1;
 	}
 
+	if (quark_queue_timer_open(qq) == -1)
+		goto fail;
+
 	return (0);
 
 fail:
@@ -1784,20 +2979,36 @@ quark_queue_close(struct quark_queue *qq)
 {
 	struct raw_event		*raw;
 	struct quark_process		*qp;
+	struct quark_thread		*qt;
 
 	/* Clean up all allocated raw events */
-	while ((raw = RB_ROOT(&qq->raw_event_by_time)) != NULL) {
+	while ((raw = raw_event_min(qq)) != NULL) {
 		raw_event_remove(qq, raw);
-		raw_event_free(raw);
+		raw_event_free(qq, raw);
 	}
+	free(qq->raw_event_heap.v);
+	qq->raw_event_heap.v = NULL;
 	if (!RB_EMPTY(&qq->raw_event_by_pidtime))
 		warnx("raw_event trees not empty");
+	raw_event_slab_destroy(qq);
 	/* Clean up all cached quark_processs */
 	while ((qp = RB_ROOT(&qq->process_by_pid)) != NULL)
 		process_cache_delete(qq, qp);
+	while ((qt = RB_ROOT(&qq->thread_by_tid)) != NULL)
+		thread_cache_delete(qq, qt);
+	pid_index_free(&qq->pid_index);
+	if (!RB_EMPTY(&qq->istr_by_value))
+		warnx("istr tree not empty");
 	/* Clean up backend */
+	if (qq->timerfd != -1) {
+		close(qq->timerfd);
+		qq->timerfd = -1;
+	}
 	if (qq->queue_ops != NULL)
 		qq->queue_ops->close(qq);
+	free(qq->filters);
+	qq->filters = NULL;
+	qq->nfilters = 0;
 }
 
 static int
@@ -1806,8 +3017,8 @@ can_aggregate(struct quark_queue *qq, struct raw_event *p, struct raw_event *c)
 	int			 kind;
 	struct raw_event	*agg;
 
-	/* Different pids can't aggregate */
-	if (p->pid != c->pid)
+	/* Different pids, or tids with QQ_THREAD_EVENTS, can't aggregate */
+	if (p->cluster != c->cluster)
 		return (0);
 
 	if (p->type >= RAW_NUM_TYPES || c->type >= RAW_NUM_TYPES ||
@@ -1856,6 +3067,7 @@ quark_queue_aggregate(struct quark_queue *qq, struct raw_event *min)
 		agg++;
 	}
 
+	hist_add(&qq->histos.fan_in, agg + 1);
 	if (agg)
 		qq->stats.aggregations++;
 	else
@@ -1865,82 +3077,117 @@ quark_queue_aggregate(struct quark_queue *qq, struct raw_event *min)
 int
 quark_queue_populate(struct quark_queue *qq)
 {
-	return (qq->queue_ops->populate(qq));
+	int	r;
+
+	qq->populate_time = now64();
+	r = qq->queue_ops->populate(qq);
+	hist_add(&qq->histos.depth, qq->length);
+
+	return (r);
 }
 
-static struct raw_event *
-quark_queue_pop_raw(struct quark_queue *qq)
+/*
+ * Copy out the next process of the initial snapshot, see quark_queue_open().
+ */
+static int
+quark_queue_snap(struct quark_queue *qq, struct quark_event *qev)
 {
-	struct raw_event	*min;
-	u64			 now;
-
-	/*
-	 * We populate before draining so we can have a fuller tree for
-	 * aggregation.
-	 */
-	(void)quark_queue_populate(qq);
+	struct quark_process	*qp;
 
-	now = now64();
-	min = RB_MIN(raw_event_by_time, &qq->raw_event_by_time);
-	if (min == NULL || !raw_event_expired(qq, min, now)) {
-		/* qq->idle++; */
-		return (NULL);
+	qp = process_cache_get(qq, qq->snap_pid, 0);
+	if (qp == NULL) {
+		warnx("event vanished during snapshot, this is a bug");
+		qq->snap_pid = -1;
+		/* errno set by cache_lookup */
+		return (-1);
 	}
+	/* Copy out to user */
+	qev->events = QUARK_EV_SNAPSHOT;
+	qev->process = qp;
+	qev->thread = NULL;
+	qp = RB_NEXT(process_by_pid, &qq->process_by_pid, qp);
+	/* Are we done with the snapshot? If not, record next */
+	if (qp == NULL)
+		qq->snap_pid = -1;
+	else
+		qq->snap_pid = qp->pid;
 
-	quark_queue_aggregate(qq, min);
-	/* qq->min = RB_NEXT(raw_event_by_time, &qq->raw_event_by_time, min); */
-	raw_event_remove(qq, min);
-
-	return (min);
+	return (0);
 }
 
 int
 quark_queue_get_events(struct quark_queue *qq, struct quark_event *qevs,
     int nqevs)
 {
-	struct raw_event	*raw;
+	struct raw_event	*raw, *next;
+	u64			 now, c0, c1;
 	int			 got;
 
 	got = 0;
-	while (got != nqevs) {
-		/* Are we in the middle of a snapshot? */
-		if (unlikely(qq->snap_pid != -1)) {
-			struct quark_process	*qp;
-
-			qp = process_cache_get(qq, qq->snap_pid, 0);
-			if (qp == NULL) {
-				warnx("event vanished during snapshot, "
-				    "this is a bug");
-				qq->snap_pid = -1;
-				/* errno set by cache_lookup */
-				return (-1);
-			}
-			/* Copy out to user */
-			qevs->events = QUARK_EV_SNAPSHOT;
-			qevs->process = qp;
-			qp = RB_NEXT(process_by_pid, &qq->process_by_pid, qp);
-			/* Are we done with the snapshot? If not, record next */
-			if (qp == NULL)
-				qq->snap_pid = -1;
-			else
-				qq->snap_pid = qp->pid;
-		} else {
-			raw = quark_queue_pop_raw(qq);
-			if (raw == NULL)
-				break;
-			if (raw_event_process(qq, raw, qevs) == -1) {
-				raw_event_free(raw);
-				warnx("raw_event_process");
-				continue;
-			}
-			raw_event_free(raw);
-		}
+	/* Are we in the middle of a snapshot? */
+	while (got != nqevs && unlikely(qq->snap_pid != -1)) {
+		if (quark_queue_snap(qq, qevs) == -1)
+			return (-1);
 		got++;
 		qevs++;
 	}
 
+	if (got == nqevs) {
+		now = now64();
+		goto gc;
+	}
+
+	/*
+	 * Populate once, before draining, so we have a fuller tree for
+	 * aggregation, then take all expired events in one ordered walk with
+	 * the same notion of now.
+	 */
+	c0 = cycles();
+	(void)quark_queue_populate(qq);
+	c1 = cycles();
+	qq->stats.populates++;
+	qq->stats.cycles_populate += c1 - c0;
+
+	now = now64();
+	raw = raw_event_min(qq);
+	while (got != nqevs && raw != NULL && raw_event_expired(qq, raw, now)) {
+		c0 = cycles();
+		qq->emitted = raw->time;
+		hist_add(&qq->histos.hold, AGE(raw->insert_time, now));
+		quark_queue_aggregate(qq, raw);
+		/*
+		 * Aggregation removes from the hold queue, so look after it,
+		 * the heap only knows its minimum once raw is gone.
+		 */
+		if (qq->flags & QQ_HOLD_HEAP) {
+			raw_event_remove(qq, raw);
+			next = raw_event_min(qq);
+		} else {
+			next = RB_NEXT(raw_event_by_time,
+			    &qq->raw_event_by_time, raw);
+			raw_event_remove(qq, raw);
+		}
+		c1 = cycles();
+		qq->stats.cycles_pop += c1 - c0;
+
+		if (raw_event_process(qq, raw, qevs) == -1)
+			warnx("raw_event_process");
+		else {
+			got++;
+			qevs++;
+		}
+		raw_event_free(qq, raw);
+		qq->stats.cycles_process += cycles() - c1;
+		raw = next;
+	}
+
+gc:
 	/* GC all processes that exited after some grace time */
-	process_cache_gc(qq);
+	c0 = cycles();
+	process_cache_gc(qq, now);
+	qq->stats.cycles_gc += cycles() - c0;
+	hist_add(&qq->histos.cache_size, qq->stats.cache_entries);
+	quark_queue_timer_arm(qq, now);
 
 	return (got);
 }
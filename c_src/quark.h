@@ -24,25 +24,44 @@ struct quark_event;
 struct quark_process;
 struct quark_process_iter;
 struct quark_queue;
+struct quark_cpu_stats;
+struct quark_filter;
 struct quark_queue_attr;
+struct quark_queue_histograms;
 struct quark_queue_stats;
-struct raw_event *raw_event_alloc(int);
-void	 raw_event_free(struct raw_event *);
+struct raw_event *raw_event_alloc(struct quark_queue *, int);
+void	 raw_event_free(struct quark_queue *, struct raw_event *);
 void	 raw_event_insert(struct quark_queue *, struct raw_event *);
+void	 raw_event_remove(struct quark_queue *, struct raw_event *);
+struct raw_event *raw_event_min(struct quark_queue *);
+int	 raw_event_snapshot(struct quark_queue *, struct raw_event *);
+u64	 now64(void);
+int	 sproc_parse_status(struct quark_process *, const char *, size_t);
+int	 sproc_parse_stat(struct quark_process *, const char *, size_t, u64 *);
 void	 quark_queue_default_attr(struct quark_queue_attr *);
 int	 quark_queue_open(struct quark_queue *, struct quark_queue_attr *);
 void	 quark_queue_close(struct quark_queue *);
 int	 quark_queue_populate(struct quark_queue *);
-int	 quark_queue_block(struct quark_queue *);
+int	 quark_queue_block(struct quark_queue *, int);
+void	 quark_queue_block_done(struct quark_queue *, u64);
 int	 quark_queue_get_events(struct quark_queue *, struct quark_event *, int);
 int	 quark_queue_get_epollfd(struct quark_queue *);
 void	 quark_queue_get_stats(struct quark_queue *, struct quark_queue_stats *);
+void	 quark_queue_get_histograms(struct quark_queue *,
+    struct quark_queue_histograms *);
+int	 quark_queue_get_cpu_stats(struct quark_queue *, struct quark_cpu_stats *,
+    int);
 int	 quark_dump_process_cache_graph(struct quark_queue *, FILE *);
 int	 quark_dump_raw_event_graph(struct quark_queue *, FILE *, FILE *);
 int	 quark_event_dump(struct quark_event *, FILE *);
 void	 quark_process_iter_init(struct quark_process_iter *, struct quark_queue *);
+void	 quark_process_children_iter_init(struct quark_process_iter *,
+    struct quark_queue *, int);
 const struct quark_process *quark_process_iter_next(struct quark_process_iter *);
 const struct quark_process *quark_process_lookup(struct quark_queue *, int);
+const char *quark_process_filename(const struct quark_process *);
+const char *quark_process_cmdline(const struct quark_process *, size_t *);
+const char *quark_process_cwd(const struct quark_process *);
 
 /* btf.c */
 struct quark_btf_target {
@@ -78,6 +97,21 @@ struct qstr {
 	char	 small[64];
 };
 
+struct qbuf {
+	char	*p;
+	size_t	 size;
+	size_t	 len;
+};
+
+/*
+ * Open addressing hash of processes keyed by pid, see pid_index_find().
+ */
+struct pid_index {
+	struct quark_process	**slots;
+	u32			  bits;		/* log2 of the number of slots */
+	u32			  count;
+};
+
 ssize_t	 qread(int, void *, size_t);
 int	 qwrite(int, const void *, size_t);
 ssize_t	 qreadlinkat(int, const char *, char *, size_t);
@@ -94,6 +128,13 @@ char	*find_line_p(const char *, const char *);
 char	*load_file_nostat(int, size_t *);
 struct args *args_make(const struct quark_process *);
 void	 args_free(struct args *);
+int	 qbuf_reserve(struct qbuf *, size_t);
+ssize_t	 qbuf_readat(struct qbuf *, int, const char *);
+void	 qbuf_free(struct qbuf *);
+struct quark_process *pid_index_find(struct pid_index *, u32);
+int	 pid_index_insert(struct pid_index *, struct quark_process *);
+void	 pid_index_remove(struct pid_index *, struct quark_process *);
+void	 pid_index_free(struct pid_index *);
 
 /*
  * Time helpers
@@ -179,7 +220,11 @@ struct raw_event {
 	u32					pid;
 	u32					tid;
 	u32					cpu;
+	u32					cluster; /* pid or tid */
 	u64					time;
+	u64					seq;	/* see raw_event_insert() */
+	u64					insert_time; /* of the populate */
+	u32					heap_idx; /* QQ_HOLD_HEAP */
 	int					type;
 	union {
 		struct raw_exec			exec;
@@ -189,6 +234,15 @@ struct raw_event {
 	};
 };
 
+/*
+ * Free list of raw events of one type, nodes are linked by agg_entry, see
+ * raw_event_alloc().
+ */
+struct raw_event_slab {
+	struct agg_queue	free;
+	u64			nfree;
+};
+
 /*
  * Raw Event Tree by time, where RB_MIN() is the oldest element in the tree, no
  * clustering of pids so we can easily get the oldest event.
@@ -203,6 +257,17 @@ RB_HEAD(raw_event_by_time, raw_event);
  */
 RB_HEAD(raw_event_by_pidtime, raw_event);
 
+/*
+ * With QQ_HOLD_HEAP, a 4-ary min-heap replaces raw_event_by_time, it's ordered
+ * by the same key and each event knows its slot so it can be removed when
+ * aggregated.
+ */
+struct raw_event_heap {
+	struct raw_event	**v;
+	u32			  len;
+	u32			  size;
+};
+
 struct quark_event {
 #define QUARK_EV_FORK		(1 << 0)
 #define QUARK_EV_EXEC		(1 << 1)
@@ -211,6 +276,8 @@ struct quark_event {
 #define QUARK_EV_SNAPSHOT	(1 << 4)
 	u64				 events;
 	const struct quark_process	*process;
+	/* Only for thread events with QQ_THREAD_EVENTS, otherwise NULL */
+	const struct quark_thread	*thread;
 };
 
 /*
@@ -218,6 +285,21 @@ struct quark_event {
  */
 RB_HEAD(process_by_pid, quark_process);
 
+/*
+ * Interned strings of the process cache, identical strings are stored once and
+ * shared by reference, see istr_get() and istr_ref().
+ */
+struct istr {
+	RB_ENTRY(istr)	entry;
+	u64		hash;
+	size_t		len;		/* excluding the terminating NUL */
+	const char	*v;		/* p, or the string of a lookup key */
+	u32		refs;
+	char		p[];
+};
+
+RB_HEAD(istr_by_value, istr);
+
 /*
  * Process cache gc list, after they are marked for deletion, they still get a
  * grace time of qq->cache_grace_time before removal, this is to allow lookups
@@ -225,6 +307,28 @@ RB_HEAD(process_by_pid, quark_process);
  */
 TAILQ_HEAD(quark_process_list, quark_process);
 
+/*
+ * Thread cache, only used with QQ_THREAD_EVENTS for threads other than the
+ * leader, the leader is the process itself. Kept small as there can be many
+ * more threads than processes, flags is a subset of the process ones.
+ */
+struct quark_thread {
+	RB_ENTRY(quark_thread)		 entry_by_tid;
+	TAILQ_ENTRY(quark_thread)	 entry_gc;
+	u64				 gc_time;
+	u64				 flags;	/* QUARK_F_COMM | QUARK_F_EXIT */
+	u32				 tid;
+	u32				 pid;
+	/* QUARK_F_EXIT */
+	s32				 exit_code;
+	u64				 exit_time_event;
+	/* QUARK_F_COMM */
+	char				 comm[16];
+};
+
+RB_HEAD(thread_by_tid, quark_thread);
+TAILQ_HEAD(quark_thread_list, quark_thread);
+
 enum {
 	QUARK_TTY_UNKNOWN,
 	QUARK_TTY_PTS,
@@ -257,6 +361,10 @@ struct quark_process {
 	RB_ENTRY(quark_process)		entry_by_pid;
 	TAILQ_ENTRY(quark_process)	entry_gc;
 	u64			 	gc_time;
+	/* Children index, follows proc_ppid */
+	struct quark_process		*parent;
+	LIST_HEAD(, quark_process)	children;
+	LIST_ENTRY(quark_process)	entry_sibling;
 #define quark_process_zero_end pid
 	/* Always present */
 	u32	pid;
@@ -267,9 +375,11 @@ struct quark_process {
 #define QUARK_F_FILENAME	(1 << 3)
 #define QUARK_F_CMDLINE		(1 << 4)
 #define QUARK_F_CWD		(1 << 5)
+#define QUARK_F_CAPS		(1 << 6)	/* proc_cap_*, with QUARK_F_PROC */
+#define QUARK_F_ALL		((1 << 7) - 1)
 	u64	flags;
 
-	/* QUARK_F_PROC */
+	/* QUARK_F_PROC, caps only if QUARK_F_CAPS */
 	u64	proc_cap_inheritable;
 	u64	proc_cap_permitted;
 	u64	proc_cap_effective;
@@ -292,20 +402,24 @@ struct quark_process {
 	/* QUARK_F_EXIT */
 	s32	exit_code;
 	u64	exit_time_event;
-	/* QUARK_F_COMM */
+	/*
+	 * QUARK_F_COMM, kept inline and not interned, it's capped at 16 bytes
+	 * by the kernel, which is less than a pointer plus a struct istr.
+	 */
 	char	comm[16];
-	/* QUARK_F_FILENAME */
-	char	filename[1024];
-	/* QUARK_F_CMDLINE */
-	size_t	cmdline_len;
-	char	cmdline[1024];
-	/* QUARK_F_CWD */
-	char	cwd[1024];
+	/* QUARK_F_FILENAME, interned */
+	const char	*filename;
+	/* QUARK_F_CMDLINE, interned */
+	size_t		 cmdline_len;
+	const char	*cmdline;
+	/* QUARK_F_CWD, interned */
+	const char	*cwd;
 };
 
 struct quark_process_iter {
 	struct quark_queue	*qq;
 	struct quark_process	*qp;
+	int			 children;
 };
 
 struct quark_queue_stats {
@@ -314,7 +428,74 @@ struct quark_queue_stats {
 	u64	aggregations;
 	u64	non_aggregations;
 	u64	lost;
-	/* TODO u64	peak_nodes; */
+	u64	slab_peak;
+	u64	slab_retained;
+	u64	cache_entries;
+	u64	cache_bytes;
+	u64	thread_entries;
+	u64	strtab_entries;
+	u64	strtab_bytes;
+	u64	strtab_saved;
+	u64	strtab_copy_saved;
+	u64	populates;
+	u64	cycles_populate;
+	u64	cycles_pop;
+	u64	cycles_process;
+	u64	cycles_gc;
+	u64	cycles_insert;
+	u64	hold_target;	/* in ns */
+	u64	late;
+	u64	wakeups;
+	u64	filtered;	/* dropped in the kernel by filters */
+};
+
+/*
+ * Per-CPU ring statistics, indexed by cpu, see quark_queue_get_cpu_stats().
+ */
+struct quark_cpu_stats {
+	u64	lost;
+	u64	sent;
+	u64	bytes;		/* consumed */
+	u64	fill;		/* bytes pending at the last drain */
+	u64	size;		/* of the ring, in bytes */
+};
+
+/*
+ * Log2 histogram, bucket n counts values in [2^(n-1), 2^n), bucket 0 counts
+ * zeroes and the last bucket everything that doesn't fit.
+ */
+#define QUARK_HIST_BUCKETS	64
+struct quark_histogram {
+	u64	count;
+	u64	sum;
+	u64	max;
+	u64	bucket[QUARK_HIST_BUCKETS];
+};
+
+struct quark_queue_histograms {
+	struct quark_histogram	ingest;		/* kernel to insert, in ns */
+	struct quark_histogram	hold;		/* insert to emit, in ns */
+	struct quark_histogram	depth;		/* hold queue length */
+	struct quark_histogram	fan_in;		/* raw events per event */
+	struct quark_histogram	cache_size;	/* process cache entries */
+};
+
+/*
+ * Kernel side filter, events about a task matching any filter are dropped, see
+ * quark_queue_open().
+ */
+struct quark_filter {
+#define QUARK_FILTER_PID	1
+#define QUARK_FILTER_TGID	2
+#define QUARK_FILTER_UID	3
+#define QUARK_FILTER_COMM	4	/* prefix */
+#define QUARK_FILTER_CGROUP	5
+	int	type;
+	union {
+		u32	id;		/* pid, tgid or uid */
+		u64	cgroup;
+		char	comm[16];
+	};
 };
 
 struct quark_queue_ops {
@@ -322,6 +503,8 @@ struct quark_queue_ops {
 	int	(*populate)(struct quark_queue *);
 	int	(*update_stats)(struct quark_queue *);
 	void	(*close)(struct quark_queue *);
+	/* optional, fills the process cache in place of scraping /proc */
+	int	(*snapshot)(struct quark_queue *);
 };
 
 struct quark_queue_attr {
@@ -331,11 +514,28 @@ struct quark_queue_attr {
 #define QQ_NO_SNAPSHOT		(1 << 3)
 #define QQ_MIN_AGG		(1 << 4)
 #define QQ_ENTRY_LEADER		(1 << 5)
+#define QQ_WATERMARK		(1 << 6)
+#define QQ_BPF_SNAPSHOT		(1 << 7)
+#define QQ_BATCH_DRAIN		(1 << 8)
+#define QQ_HOLD_HEAP		(1 << 9)
+#define QQ_RING_GROW		(1 << 10)
+#define QQ_LAZY_WAKEUP		(1 << 11)
+#define QQ_RINGBUF_PERCPU	(1 << 12)
+#define QQ_RINGBUF_PERNODE	(1 << 13)
 #define QQ_ALL_BACKENDS		(QQ_KPROBE | QQ_EBPF)
 	int	flags;
 	int	max_length;
 	int	cache_grace_time;	/* in ms */
 	int	hold_time;		/* in ms */
+	int	agg_window;		/* in ms, only with QQ_WATERMARK */
+	int	scrape_threads;
+	int	hold_percentile;	/* 0 for a fixed hold_time */
+	int	ring_pages;		/* per cpu, only with QQ_KPROBE */
+	int	ring_wakeup;		/* in % of ring_pages or ringbuf_size */
+	int	ringbuf_size;		/* in bytes, only with QQ_EBPF */
+	const struct quark_filter *filters;
+	int	nfilters;
+	u64	field_mask;		/* QUARK_F_* we want */
 };
 
 /*
@@ -345,18 +545,51 @@ struct quark_queue_attr {
 struct quark_queue {
 	struct raw_event_by_time	 raw_event_by_time;
 	struct raw_event_by_pidtime	 raw_event_by_pidtime;
+	struct raw_event_heap		 raw_event_heap;
 	struct process_by_pid		 process_by_pid;
+	struct pid_index		 pid_index;
 	struct quark_process_list	 event_gc;
+	struct thread_by_tid		 thread_by_tid;
+	struct quark_thread_list	 thread_gc;
+	struct istr_by_value		 istr_by_value;
+	struct raw_event_slab		 raw_event_slab[RAW_NUM_TYPES];
+	u64				 slab_alive;
+	u64				 seq;		/* of the next raw_event */
 	struct quark_queue_stats	 stats;
+	struct quark_queue_histograms	 histos;
+	struct quark_cpu_stats		*cpu_stats;	/* set by the backend */
+	int				 num_cpus;
+	u64				 populate_time;	/* in ns */
 	const u8			(*agg_matrix)[RAW_NUM_TYPES];
 	int				 flags;
 	int				 length;
 	int				 max_length;
 	u64				 cache_grace_time;	/* in ns */
 	int				 hold_time;		/* in ms */
+	u64				 agg_window;		/* in ns */
+	int				 ring_pages;
+	int				 ring_wakeup;
+	int				 ringbuf_size;
+	struct quark_filter		*filters;
+	int				 nfilters;
+	u64				 field_mask;
+	/* Adaptive hold, see raw_event_skew() */
+	int				 hold_percentile;
+	u64				 hold_target;		/* in ns */
+	u64				 newest;		/* in ns */
+	u64				 emitted;		/* in ns */
+	u32				 skew_samples;
+	u32				 skew_hist[QUARK_HIST_BUCKETS];
+	/* Low watermark of all rings, set by the backend on populate */
+	u64				 watermark;		/* in ns */
 	/* Next pid to be sent out of a snapshot */
 	int				 snap_pid;
 	int				 epollfd;
+	/* Fires when there is work in the hold queue or the cache to expire */
+	int				 timerfd;
+	u64				 timer_deadline;	/* in ns */
+	/* How long a ring may sit on events without waking us, set by the backend */
+	u64				 ring_tick;		/* in ns */
 	/* Backend related state */
 	struct quark_queue_ops		*queue_ops;
 	void				*queue_be;
@@ -310,3 +310,189 @@ args_free(struct args *args) {
 	free(args->buf);
 	free(args);
 }
+
+/*
+ * Growable buffer meant to be reused, p[0, len) is kept, the rest is scratch
+ * space for reading.
+ */
+int
+qbuf_reserve(struct qbuf *qb, size_t n)
+{
+	size_t	 size;
+	char	*p;
+
+	if (qb->size - qb->len >= n)
+		return (0);
+	for (size = qb->size == 0 ? 4096 : qb->size; size - qb->len < n;)
+		size *= 2;
+	if ((p = realloc(qb->p, size)) == NULL)
+		return (-1);
+	qb->p = p;
+	qb->size = size;
+
+	return (0);
+}
+
+/*
+ * Read a whole file into the scratch space of qb, the result starts at
+ * qb->p + qb->len and is NUL terminated, returns its length excluding NUL.
+ * Nothing is kept unless the caller bumps qb->len.
+ */
+ssize_t
+qbuf_readat(struct qbuf *qb, int dfd, const char *pathname)
+{
+	int	fd;
+	ssize_t	n;
+	size_t	copied;
+
+	if ((fd = openat(dfd, pathname, O_RDONLY)) == -1)
+		return (-1);
+	copied = 0;
+	for (; ;) {
+		/* One extra for NUL */
+		if (qbuf_reserve(qb, copied + 2) == -1)
+			goto fail;
+		n = qread(fd, qb->p + qb->len + copied,
+		    qb->size - qb->len - copied - 1);
+		if (n == -1)
+			goto fail;
+		else if (n == 0)
+			break;
+		copied += n;
+	}
+	close(fd);
+	qb->p[qb->len + copied] = 0;
+
+	return (copied);
+
+fail:
+	close(fd);
+
+	return (-1);
+}
+
+void
+qbuf_free(struct qbuf *qb)
+{
+	free(qb->p);
+	qb->p = NULL;
+	qb->size = qb->len = 0;
+}
+
+/*
+ * Pids are dense and bounded by pid_max, a linear probing table of pointers
+ * gives constant time lookups without having to size it to pid_max. It grows
+ * by doubling when half full and never shrinks, pid_max is at most 2^22, so
+ * the worst case is 2^23 slots.
+ */
+#define PID_INDEX_MIN_BITS	10
+
+static inline u32
+pid_index_slot(struct pid_index *pi, u32 pid)
+{
+	/* Fibonacci hashing, takes the top bits */
+	return ((pid * 0x9e3779b1U) >> (32 - pi->bits));
+}
+
+static void
+pid_index_insert1(struct pid_index *pi, struct quark_process *qp)
+{
+	u32	i, mask;
+
+	mask = (1U << pi->bits) - 1;
+	for (i = pid_index_slot(pi, qp->pid); pi->slots[i] != NULL;
+	    i = (i + 1) & mask)
+		;
+	pi->slots[i] = qp;
+}
+
+static int
+pid_index_grow(struct pid_index *pi)
+{
+	struct pid_index	 new;
+	u32			 i;
+
+	new.bits = pi->bits == 0 ? PID_INDEX_MIN_BITS : pi->bits + 1;
+	new.count = pi->count;
+	if ((new.slots = calloc(1U << new.bits, sizeof(*new.slots))) == NULL)
+		return (-1);
+	for (i = 0; pi->slots != NULL && i < (1U << pi->bits); i++) {
+		if (pi->slots[i] != NULL)
+			pid_index_insert1(&new, pi->slots[i]);
+	}
+	free(pi->slots);
+	*pi = new;
+
+	return (0);
+}
+
+struct quark_process *
+pid_index_find(struct pid_index *pi, u32 pid)
+{
+	struct quark_process	*qp;
+	u32			 i, mask;
+
+	if (pi->slots == NULL)
+		return (NULL);
+	mask = (1U << pi->bits) - 1;
+	for (i = pid_index_slot(pi, pid); (qp = pi->slots[i]) != NULL;
+	    i = (i + 1) & mask) {
+		if (qp->pid == pid)
+			return (qp);
+	}
+
+	return (NULL);
+}
+
+int
+pid_index_insert(struct pid_index *pi, struct quark_process *qp)
+{
+	if (pid_index_find(pi, qp->pid) != NULL)
+		return (errno = EEXIST, -1);
+	if ((pi->count + 1) * 2 > (1U << pi->bits) &&
+	    pid_index_grow(pi) == -1)
+		return (-1);
+	pid_index_insert1(pi, qp);
+	pi->count++;
+
+	return (0);
+}
+
+void
+pid_index_remove(struct pid_index *pi, struct quark_process *qp)
+{
+	u32	i, j, k, mask;
+
+	if (pi->slots == NULL)
+		return;
+	mask = (1U << pi->bits) - 1;
+	for (i = pid_index_slot(pi, qp->pid); pi->slots[i] != qp;
+	    i = (i + 1) & mask) {
+		if (pi->slots[i] == NULL)
+			return;
+	}
+	pi->slots[i] = NULL;
+	pi->count--;
+
+	/*
+	 * No tombstones, shift back the entries of the cluster that would no
+	 * longer be reachable from their home slot.
+	 */
+	for (j = (i + 1) & mask; pi->slots[j] != NULL; j = (j + 1) & mask) {
+		k = pid_index_slot(pi, pi->slots[j]->pid);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		pi->slots[i] = pi->slots[j];
+		pi->slots[j] = NULL;
+		i = j;
+	}
+}
+
+void
+pid_index_free(struct pid_index *pi)
+{
+	free(pi->slots);
+	pi->slots = NULL;
+	pi->bits = 0;
+	pi->count = 0;
+}
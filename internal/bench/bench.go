@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (c) 2024 Elastic NV
+
+//go:build linux && (amd64 || arm64)
+
+// Package bench has the cgo helpers for the benchmarks in quark_test.go, test
+// files can't use cgo. It reaches into library internals and is only meant
+// to be imported by tests, so nothing of it ends up in users of quark.
+package bench
+
+/*
+   #cgo CFLAGS: -I${SRCDIR}/../../c_src
+   #cgo LDFLAGS: ${SRCDIR}/../../c_src/libquark_big.a -lpthread
+
+   #include <ctype.h>
+   #include <fcntl.h>
+   #include <stdio.h>
+   #include <stdlib.h>
+   #include <string.h>
+   #include <unistd.h>
+
+   #include "quark.h"
+
+   RB_PROTOTYPE(process_by_pid, quark_process, entry_by_pid, process_by_pid_cmp);
+
+   // Bytes a cached process would grow by if filename, cmdline and cwd were
+   // still the char[1024] arrays embedded in struct quark_process.
+   #define BENCH_INLINE_STRINGS_DELTA					\
+	(3 * 1024 - sizeof(((struct quark_process *)0)->filename) -	\
+	sizeof(((struct quark_process *)0)->cmdline) -			\
+	sizeof(((struct quark_process *)0)->cwd))
+
+   // Pids are dense, walk them in a scattered order so we don't just hit
+   // the same cache lines.
+   static u32
+   bench_pid(u64 i, int n)
+   {
+	return (1 + ((i * 2654435761ULL) % n));
+   }
+
+   static struct quark_process *
+   bench_procs(int n)
+   {
+	struct quark_process	*procs;
+	int			 i;
+
+	if ((procs = calloc(n, sizeof(*procs))) == NULL)
+		return (NULL);
+	for (i = 0; i < n; i++)
+		procs[i].pid = bench_pid(i, n);
+
+	return (procs);
+   }
+
+   static void
+   bench_insert(struct pid_index *pi, struct process_by_pid *tree,
+       struct quark_process *procs, int n)
+   {
+	int	i;
+
+	for (i = 0; i < n; i++) {
+		if (pi != NULL)
+			pid_index_insert(pi, &procs[i]);
+		else
+			process_by_pid_RB_INSERT(tree, &procs[i]);
+	}
+   }
+
+   static u64
+   bench_lookup(struct pid_index *pi, struct process_by_pid *tree, int n,
+       int iters)
+   {
+	struct quark_process	 key, *qp;
+	u64			 i, found;
+
+	for (i = 0, found = 0; i < (u64)iters; i++) {
+		if (pi != NULL)
+			qp = pid_index_find(pi, bench_pid(i, n));
+		else {
+			key.pid = bench_pid(i, n);
+			qp = process_by_pid_RB_FIND(tree, &key);
+		}
+		found += qp != NULL;
+	}
+
+	return (found);
+   }
+
+   // Raw events as 8 cpus would produce them, with ties every 8 events
+   // timestamps collide across all cpus.
+   static struct raw_event *
+   bench_raws(int n, int ties)
+   {
+	struct raw_event	*raws;
+	int			 i;
+
+	if ((raws = calloc(n, sizeof(*raws))) == NULL)
+		return (NULL);
+	for (i = 0; i < n; i++) {
+		raws[i].type = RAW_COMM;
+		raws[i].pid = 1 + (i % 64);
+		raws[i].cpu = i % 8;
+		raws[i].time = ties ? (u64)i / 8 : (u64)i;
+	}
+
+	return (raws);
+   }
+
+   static void
+   bench_raw_insert(struct quark_queue *qq, struct raw_event *raws, int n)
+   {
+	int	i;
+
+	RB_INIT(&qq->raw_event_by_time);
+	RB_INIT(&qq->raw_event_by_pidtime);
+	qq->length = 0;
+	for (i = 0; i < n; i++)
+		raw_event_insert(qq, &raws[i]);
+   }
+
+   // A hold queue of n events with scattered timestamps, either the
+   // raw_event_by_time tree or the heap.
+   static struct quark_queue *
+   bench_hold_open(int n, int heap)
+   {
+	struct quark_queue	*qq;
+	struct raw_event	*raw;
+	int			 i;
+
+	if ((qq = calloc(1, sizeof(*qq))) == NULL)
+		return (NULL);
+	RB_INIT(&qq->raw_event_by_time);
+	RB_INIT(&qq->raw_event_by_pidtime);
+	qq->flags = heap ? QQ_HOLD_HEAP : 0;
+	for (i = 0; i < n; i++) {
+		if ((raw = raw_event_alloc(qq, RAW_COMM)) == NULL)
+			abort();
+		raw->pid = 1 + (i % 64);
+		raw->time = bench_pid(i, n);
+		raw_event_insert(qq, raw);
+	}
+
+	return (qq);
+   }
+
+   // Steady state of a full queue, pop the oldest and insert a younger one.
+   static void
+   bench_hold_churn(struct quark_queue *qq, int n, int iters)
+   {
+	struct raw_event	*raw;
+	int			 i;
+
+	for (i = 0; i < iters; i++) {
+		raw = raw_event_min(qq);
+		raw_event_remove(qq, raw);
+		raw->time += bench_pid(i, n);
+		raw_event_insert(qq, raw);
+	}
+   }
+
+   static void
+   bench_hold_close(struct quark_queue *qq)
+   {
+	struct raw_event	*raw;
+
+	while ((raw = raw_event_min(qq)) != NULL) {
+		raw_event_remove(qq, raw);
+		free(raw);
+	}
+	free(qq->raw_event_heap.v);
+	free(qq);
+   }
+
+   // The /proc parsers as they were before sproc_parse_status() and
+   // sproc_parse_stat(), stdio and sscanf(3) based, kept for comparison.
+   static int
+   bench_old_status_line(struct quark_process *qp, const char *k, const char *v)
+   {
+	const char	*errstr;
+
+	if (*v == 0)
+		return (0);
+	if (!strcmp(k, "Pid")) {
+		qp->pid = strtonum(v, 0, UINT32_MAX, &errstr);
+		if (errstr != NULL)
+			return (-1);
+	} else if (!strcmp(k, "PPid")) {
+		qp->proc_ppid = strtonum(v, 0, UINT32_MAX, &errstr);
+		if (errstr != NULL)
+			return (-1);
+	} else if (!strcmp(k, "Uid")) {
+		if (sscanf(v, "%d %d %d\n",
+		    &qp->proc_uid, &qp->proc_euid, &qp->proc_suid) != 3)
+			return (-1);
+	} else if (!strcmp(k, "Gid")) {
+		if (sscanf(v, "%d %d %d\n",
+		    &qp->proc_gid, &qp->proc_egid, &qp->proc_sgid) != 3)
+			return (-1);
+	} else if (!strcmp(k, "CapInh")) {
+		return (strtou64(&qp->proc_cap_inheritable, v, 16));
+	} else if (!strcmp(k, "CapPrm")) {
+		return (strtou64(&qp->proc_cap_permitted, v, 16));
+	} else if (!strcmp(k, "CapEff")) {
+		return (strtou64(&qp->proc_cap_effective, v, 16));
+	} else if (!strcmp(k, "CapBnd")) {
+		return (strtou64(&qp->proc_cap_bset, v, 16));
+	} else if (!strcmp(k, "CapAmb")) {
+		return (strtou64(&qp->proc_cap_ambient, v, 16));
+	}
+
+	return (0);
+   }
+
+   static int
+   bench_old_status(struct quark_process *qp, int dfd)
+   {
+	int	 fd, ret;
+	FILE	*f;
+	ssize_t	 n;
+	size_t	 line_len;
+	char	*line, *v;
+
+	if ((fd = openat(dfd, "status", O_RDONLY)) == -1)
+		return (-1);
+	if ((f = fdopen(fd, "r")) == NULL)
+		return (-1);
+	ret = 0;
+	line_len = 0;
+	line = NULL;
+	while ((n = getline(&line, &line_len, f)) != -1) {
+		if (n < 5 || line[n - 1] != '\n') {
+			ret = -1;
+			break;
+		}
+		line[n - 1] = 0;
+		if ((v = strstr(line, ":\t")) == NULL) {
+			ret = -1;
+			break;
+		}
+		*v = 0;
+		v += 2;
+		if (bench_old_status_line(qp, line, v) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+
+	return (ret);
+   }
+
+   static int
+   bench_old_stat(struct quark_process *qp, int dfd)
+   {
+	int			 fd, r;
+	char			*buf, *p;
+	unsigned long long	 starttime;
+
+	if ((fd = openat(dfd, "stat", O_RDONLY)) == -1)
+		return (-1);
+	buf = load_file_nostat(fd, NULL);
+	close(fd);
+	if (buf == NULL || (p = strrchr(buf, ')')) == NULL) {
+		free(buf);
+		return (-1);
+	}
+	p++;
+	while (isspace(*p))
+		p++;
+	r = sscanf(p, "%*s %*s %d %d %d %*s %*s %*s %*s %*s %*s %*s %*s "
+	    "%*s %*s %*s %*s %*s %*s %llu ",
+	    &qp->proc_pgid, &qp->proc_sid, &qp->proc_tty_major, &starttime);
+	free(buf);
+
+	return (r == 4 ? 0 : -1);
+   }
+
+   static int
+   bench_old_cmdline(int dfd)
+   {
+	int	 fd;
+	char	*buf;
+	size_t	 len;
+
+	if ((fd = openat(dfd, "cmdline", O_RDONLY)) == -1)
+		return (-1);
+	buf = load_file_nostat(fd, &len);
+	close(fd);
+	free(buf);
+
+	return (buf == NULL ? -1 : 0);
+   }
+
+   // Parse status, stat and cmdline of the npids directories named 0 to
+   // npids - 1 under corpus, iters times.
+   static int
+   bench_sproc(const char *corpus, int npids, int old, int iters)
+   {
+	struct quark_process	 qp;
+	struct qbuf		 qb;
+	int			 rootfd, dfd, i, it, failed;
+	ssize_t			 n;
+	u64			 starttime;
+	char			 name[16];
+
+	if ((rootfd = open(corpus, O_RDONLY | O_DIRECTORY)) == -1)
+		return (-1);
+	bzero(&qb, sizeof(qb));
+	failed = 0;
+	for (it = 0; it < iters; it++) {
+		for (i = 0; i < npids; i++) {
+			snprintf(name, sizeof(name), "%d", i);
+			if ((dfd = openat(rootfd, name, O_RDONLY | O_DIRECTORY)) == -1) {
+				failed++;
+				continue;
+			}
+			bzero(&qp, sizeof(qp));
+			if (old) {
+				failed += bench_old_status(&qp, dfd) == -1;
+				failed += bench_old_stat(&qp, dfd) == -1;
+				failed += bench_old_cmdline(dfd) == -1;
+			} else {
+				n = qbuf_readat(&qb, dfd, "status");
+				failed += n == -1 ||
+				    sproc_parse_status(&qp, qb.p, n) == -1;
+				n = qbuf_readat(&qb, dfd, "stat");
+				failed += n == -1 ||
+				    sproc_parse_stat(&qp, qb.p, n,
+				    &starttime) == -1;
+				failed += qbuf_readat(&qb, dfd, "cmdline") == -1;
+			}
+			close(dfd);
+		}
+	}
+	qbuf_free(&qb);
+	close(rootfd);
+
+	return (failed);
+   }
+*/
+import "C"
+
+import (
+	"unsafe"
+)
+
+// cBool is how the C helpers take their knobs.
+func cBool(v bool) C.int {
+	if v {
+		return 1
+	}
+	return 0
+}
+
+// mustAlloc panics if any of the fixture allocations failed, there's no
+// point in benchmarking with a partial fixture.
+func mustAlloc(ptrs ...unsafe.Pointer) {
+	for _, p := range ptrs {
+		if p == nil {
+			panic("calloc")
+		}
+	}
+}
+
+// InlineCacheBytes is what a process cache of entries processes, costing
+// cacheBytes of which strtabBytes are the interned strings, would cost with
+// the strings inline as they used to be. It's the baseline for the
+// out-of-line strings.
+func InlineCacheBytes(cacheBytes, strtabBytes, entries uint64) uint64 {
+	return cacheBytes - strtabBytes + entries*uint64(C.BENCH_INLINE_STRINGS_DELTA)
+}
+
+// Cache is a process cache with n fake processes, indexed either by the pid
+// index or by the RB tree.
+type Cache struct {
+	procs  *C.struct_quark_process
+	n      int
+	rbtree bool
+	index  *C.struct_pid_index
+	tree   *C.struct_process_by_pid
+}
+
+func NewCache(n int, rbtree bool) *Cache {
+	bc := &Cache{n: n, rbtree: rbtree}
+	bc.procs = C.bench_procs(C.int(n))
+	bc.index = (*C.struct_pid_index)(C.calloc(1, C.sizeof_struct_pid_index))
+	bc.tree = (*C.struct_process_by_pid)(C.calloc(1, C.sizeof_struct_process_by_pid))
+	mustAlloc(unsafe.Pointer(bc.procs), unsafe.Pointer(bc.index),
+		unsafe.Pointer(bc.tree))
+
+	return bc
+}
+
+func (bc *Cache) Insert() {
+	if bc.rbtree {
+		C.bench_insert(nil, bc.tree, bc.procs, C.int(bc.n))
+	} else {
+		C.bench_insert(bc.index, nil, bc.procs, C.int(bc.n))
+	}
+}
+
+func (bc *Cache) Lookup(iters int) uint64 {
+	if bc.rbtree {
+		return uint64(C.bench_lookup(nil, bc.tree, C.int(bc.n), C.int(iters)))
+	}
+	return uint64(C.bench_lookup(bc.index, nil, C.int(bc.n), C.int(iters)))
+}
+
+func (bc *Cache) Reset() {
+	C.pid_index_free(bc.index)
+	*bc.tree = C.struct_process_by_pid{}
+}
+
+func (bc *Cache) Free() {
+	C.pid_index_free(bc.index)
+	C.free(unsafe.Pointer(bc.procs))
+	C.free(unsafe.Pointer(bc.index))
+	C.free(unsafe.Pointer(bc.tree))
+}
+
+// Sproc runs the /proc parsers over a corpus of npids directories named 0 to
+// npids - 1, each with a copy of status, stat and cmdline. Returns the number
+// of failed parses.
+func Sproc(corpus string, npids int, old bool, iters int) int {
+	cCorpus := C.CString(corpus)
+	defer C.free(unsafe.Pointer(cCorpus))
+
+	return int(C.bench_sproc(cCorpus, C.int(npids), cBool(old), C.int(iters)))
+}
+
+// Queue is a bare queue and n raw events to be inserted into it.
+type Queue struct {
+	qq   *C.struct_quark_queue
+	raws *C.struct_raw_event
+	n    int
+}
+
+func NewQueue(n int, ties bool) *Queue {
+	bq := &Queue{n: n}
+	bq.qq = (*C.struct_quark_queue)(C.calloc(1, C.sizeof_struct_quark_queue))
+	bq.raws = C.bench_raws(C.int(n), cBool(ties))
+	mustAlloc(unsafe.Pointer(bq.qq), unsafe.Pointer(bq.raws))
+
+	return bq
+}
+
+func (bq *Queue) Insert() {
+	C.bench_raw_insert(bq.qq, bq.raws, C.int(bq.n))
+}
+
+func (bq *Queue) Free() {
+	C.free(unsafe.Pointer(bq.qq))
+	C.free(unsafe.Pointer(bq.raws))
+}
+
+// Hold is a full hold queue of n events.
+type Hold struct {
+	qq *C.struct_quark_queue
+	n  int
+}
+
+func NewHold(n int, heap bool) *Hold {
+	bh := &Hold{n: n}
+	bh.qq = C.bench_hold_open(C.int(n), cBool(heap))
+	mustAlloc(unsafe.Pointer(bh.qq))
+
+	return bh
+}
+
+func (bh *Hold) Churn(iters int) {
+	C.bench_hold_churn(bh.qq, C.int(bh.n), C.int(iters))
+}
+
+func (bh *Hold) Free() {
+	C.bench_hold_close(bh.qq)
+}
@@ -8,7 +8,7 @@ package quark
 
 /*
    #cgo CFLAGS: -I${SRCDIR}/c_src
-   #cgo LDFLAGS: ${SRCDIR}/c_src/libquark_big.a
+   #cgo LDFLAGS: ${SRCDIR}/c_src/libquark_big.a -lpthread
 
    #include <stdlib.h>
    #include "quark.h"
@@ -20,6 +20,7 @@ import (
 	"errors"
 	"strings"
 	"syscall"
+	"time"
 	"unsafe"
 )
 
@@ -66,11 +67,74 @@ type Process struct {
 	Cwd      string   // QUARK_F_CWD
 }
 
+// Thread is a thread other than the leader, only with QQ_THREAD_EVENTS.
+type Thread struct {
+	Tid  uint32
+	Comm string // QUARK_F_COMM
+	Exit Exit   // Only meaningful if Exit.Valid (QUARK_F_EXIT)
+}
+
 // Events is a bitmask of QUARK_EV_* and expresses what triggered this
-// event, Process is the context of the Event.
+// event, Process is the context of the Event. Thread is set for thread
+// events, in which case Events refers to the thread and not the process.
 type Event struct {
 	Events  uint64
 	Process Process
+	Thread  *Thread
+}
+
+// Stats are the queue statistics, see quark_queue_get_stats(3).
+type Stats struct {
+	Insertions      uint64
+	Removals        uint64
+	Aggregations    uint64
+	NonAggregations uint64
+	Lost            uint64
+	SlabPeak        uint64
+	SlabRetained    uint64
+	CacheEntries    uint64
+	CacheBytes      uint64
+	ThreadEntries   uint64
+	StrtabEntries   uint64
+	StrtabBytes     uint64
+	StrtabSaved     uint64
+	StrtabCopySaved uint64
+	Populates       uint64
+	CyclesPopulate  uint64
+	CyclesPop       uint64
+	CyclesProcess   uint64
+	CyclesGc        uint64
+	CyclesInsert    uint64
+	HoldTarget      uint64
+	Late            uint64
+	Wakeups         uint64
+	Filtered        uint64
+}
+
+// Histogram is a log2 histogram, Bucket[n] counts values in [2^(n-1), 2^n).
+type Histogram struct {
+	Count  uint64
+	Sum    uint64
+	Max    uint64
+	Bucket [C.QUARK_HIST_BUCKETS]uint64
+}
+
+// Histograms are the queue histograms, see quark_queue_get_histograms(3).
+type Histograms struct {
+	Ingest    Histogram
+	Hold      Histogram
+	Depth     Histogram
+	FanIn     Histogram
+	CacheSize Histogram
+}
+
+// CPUStats are the ring statistics of one cpu, see quark_queue_get_cpu_stats(3).
+type CPUStats struct {
+	Lost  uint64
+	Sent  uint64
+	Bytes uint64
+	Fill  uint64
+	Size  uint64
 }
 
 // Queue holds the state of a quark instance.
@@ -83,13 +147,38 @@ type Queue struct {
 
 const (
 	// quark_queue_attr{} flags
-	QQ_THREAD_EVENTS = int(C.QQ_THREAD_EVENTS)
-	QQ_KPROBE        = int(C.QQ_KPROBE)
-	QQ_EBPF          = int(C.QQ_EBPF)
-	QQ_NO_SNAPSHOT   = int(C.QQ_NO_SNAPSHOT)
-	QQ_MIN_AGG       = int(C.QQ_MIN_AGG)
-	QQ_ENTRY_LEADER  = int(C.QQ_ENTRY_LEADER)
-	QQ_ALL_BACKENDS  = int(C.QQ_ALL_BACKENDS)
+	QQ_THREAD_EVENTS   = int(C.QQ_THREAD_EVENTS)
+	QQ_KPROBE          = int(C.QQ_KPROBE)
+	QQ_EBPF            = int(C.QQ_EBPF)
+	QQ_NO_SNAPSHOT     = int(C.QQ_NO_SNAPSHOT)
+	QQ_MIN_AGG         = int(C.QQ_MIN_AGG)
+	QQ_ENTRY_LEADER    = int(C.QQ_ENTRY_LEADER)
+	QQ_WATERMARK       = int(C.QQ_WATERMARK)
+	QQ_BPF_SNAPSHOT    = int(C.QQ_BPF_SNAPSHOT)
+	QQ_BATCH_DRAIN     = int(C.QQ_BATCH_DRAIN)
+	QQ_HOLD_HEAP       = int(C.QQ_HOLD_HEAP)
+	QQ_RING_GROW       = int(C.QQ_RING_GROW)
+	QQ_LAZY_WAKEUP     = int(C.QQ_LAZY_WAKEUP)
+	QQ_RINGBUF_PERCPU  = int(C.QQ_RINGBUF_PERCPU)
+	QQ_RINGBUF_PERNODE = int(C.QQ_RINGBUF_PERNODE)
+	QQ_ALL_BACKENDS    = int(C.QQ_ALL_BACKENDS)
+
+	// Filter.Type
+	QUARK_FILTER_PID    = int(C.QUARK_FILTER_PID)
+	QUARK_FILTER_TGID   = int(C.QUARK_FILTER_TGID)
+	QUARK_FILTER_UID    = int(C.QUARK_FILTER_UID)
+	QUARK_FILTER_COMM   = int(C.QUARK_FILTER_COMM)
+	QUARK_FILTER_CGROUP = int(C.QUARK_FILTER_CGROUP)
+
+	// QueueAttr.FieldMask
+	QUARK_F_PROC     = uint64(C.QUARK_F_PROC)
+	QUARK_F_EXIT     = uint64(C.QUARK_F_EXIT)
+	QUARK_F_COMM     = uint64(C.QUARK_F_COMM)
+	QUARK_F_FILENAME = uint64(C.QUARK_F_FILENAME)
+	QUARK_F_CMDLINE  = uint64(C.QUARK_F_CMDLINE)
+	QUARK_F_CWD      = uint64(C.QUARK_F_CWD)
+	QUARK_F_CAPS     = uint64(C.QUARK_F_CAPS)
+	QUARK_F_ALL      = uint64(C.QUARK_F_ALL)
 
 	// Event.events
 	QUARK_EV_FORK         = uint64(C.QUARK_EV_FORK)
@@ -115,6 +204,23 @@ type QueueAttr struct {
 	MaxLength      int
 	CacheGraceTime int
 	HoldTime       int
+	AggWindow      int
+	ScrapeThreads  int
+	HoldPercentile int
+	RingPages      int
+	RingWakeup     int
+	RingbufSize    int
+	Filters        []Filter
+	FieldMask      uint64
+}
+
+// Filter drops events about matching tasks in the kernel, see quark_queue_open(3).
+// ID is used by QUARK_FILTER_PID, QUARK_FILTER_TGID and QUARK_FILTER_UID.
+type Filter struct {
+	Type   int
+	ID     uint32
+	Cgroup uint64
+	Comm   string
 }
 
 var ErrUndefined = errors.New("undefined")
@@ -138,6 +244,13 @@ func DefaultQueueAttr() QueueAttr {
 		MaxLength:      int(attr.max_length),
 		CacheGraceTime: int(attr.cache_grace_time),
 		HoldTime:       int(attr.hold_time),
+		AggWindow:      int(attr.agg_window),
+		ScrapeThreads:  int(attr.scrape_threads),
+		HoldPercentile: int(attr.hold_percentile),
+		RingPages:      int(attr.ring_pages),
+		RingWakeup:     int(attr.ring_wakeup),
+		RingbufSize:    int(attr.ringbuf_size),
+		FieldMask:      uint64(attr.field_mask),
 	}
 }
 
@@ -157,8 +270,28 @@ func OpenQueue(attr QueueAttr, slots int) (*Queue, error) {
 		max_length:       C.int(attr.MaxLength),
 		cache_grace_time: C.int(attr.CacheGraceTime),
 		hold_time:        C.int(attr.HoldTime),
+		agg_window:       C.int(attr.AggWindow),
+		scrape_threads:   C.int(attr.ScrapeThreads),
+		hold_percentile:  C.int(attr.HoldPercentile),
+		ring_pages:       C.int(attr.RingPages),
+		ring_wakeup:      C.int(attr.RingWakeup),
+		ringbuf_size:     C.int(attr.RingbufSize),
+		field_mask:       C.u64(attr.FieldMask),
 	}
+	if len(attr.Filters) > 0 {
+		p, err = C.calloc(C.size_t(len(attr.Filters)), C.sizeof_struct_quark_filter)
+		if p == nil {
+			C.free(unsafe.Pointer(queue.quarkQueue))
+			return nil, wrapErrno(err)
+		}
+		filtersToC(attr.Filters, p)
+		cattr.filters = (*C.struct_quark_filter)(p)
+		cattr.nfilters = C.int(len(attr.Filters))
+		p = nil
+	}
+	// Filters are copied by quark_queue_open
 	ok, err := C.quark_queue_open(queue.quarkQueue, &cattr)
+	C.free(unsafe.Pointer(cattr.filters))
 	if ok == -1 {
 		C.free(unsafe.Pointer(queue.quarkQueue))
 		return nil, wrapErrno(err)
@@ -179,6 +312,23 @@ func OpenQueue(attr QueueAttr, slots int) (*Queue, error) {
 	return &queue, nil
 }
 
+// filtersToC fills the C array at p, the union in quark_filter is opaque to cgo.
+func filtersToC(filters []Filter, p unsafe.Pointer) {
+	for i, f := range filters {
+		cf := (*C.struct_quark_filter)(unsafe.Add(p, i*C.sizeof_struct_quark_filter))
+		cf._type = C.int(f.Type)
+		u := unsafe.Pointer(&cf.anon0)
+		switch f.Type {
+		case QUARK_FILTER_CGROUP:
+			*(*C.u64)(u) = C.u64(f.Cgroup)
+		case QUARK_FILTER_COMM:
+			copy((*[16]byte)(u)[:], f.Comm)
+		default:
+			*(*C.u32)(u) = C.u32(f.ID)
+		}
+	}
+}
+
 // Close closes the queue.
 func (queue *Queue) Close() {
 	C.quark_queue_close(queue.quarkQueue)
@@ -218,14 +368,115 @@ func (queue *Queue) Lookup(pid int) (Process, bool) {
 	return processToGo(process), true
 }
 
-// Block blocks until there are events or an undefined timeout
-// expires. GetEvents should be called once Block returns.
-func (queue *Queue) Block() error {
+// Stats returns the queue statistics.
+func (queue *Queue) Stats() Stats {
+	var s C.struct_quark_queue_stats
+
+	C.quark_queue_get_stats(queue.quarkQueue, &s)
+
+	return Stats{
+		Insertions:      uint64(s.insertions),
+		Removals:        uint64(s.removals),
+		Aggregations:    uint64(s.aggregations),
+		NonAggregations: uint64(s.non_aggregations),
+		Lost:            uint64(s.lost),
+		SlabPeak:        uint64(s.slab_peak),
+		SlabRetained:    uint64(s.slab_retained),
+		CacheEntries:    uint64(s.cache_entries),
+		CacheBytes:      uint64(s.cache_bytes),
+		ThreadEntries:   uint64(s.thread_entries),
+		StrtabEntries:   uint64(s.strtab_entries),
+		StrtabBytes:     uint64(s.strtab_bytes),
+		StrtabSaved:     uint64(s.strtab_saved),
+		StrtabCopySaved: uint64(s.strtab_copy_saved),
+		Populates:       uint64(s.populates),
+		CyclesPopulate:  uint64(s.cycles_populate),
+		CyclesPop:       uint64(s.cycles_pop),
+		CyclesProcess:   uint64(s.cycles_process),
+		CyclesGc:        uint64(s.cycles_gc),
+		CyclesInsert:    uint64(s.cycles_insert),
+		HoldTarget:      uint64(s.hold_target),
+		Late:            uint64(s.late),
+		Wakeups:         uint64(s.wakeups),
+		Filtered:        uint64(s.filtered),
+	}
+}
+
+func histogramToGo(h *C.struct_quark_histogram) Histogram {
+	hist := Histogram{
+		Count: uint64(h.count),
+		Sum:   uint64(h.sum),
+		Max:   uint64(h.max),
+	}
+	for i := range hist.Bucket {
+		hist.Bucket[i] = uint64(h.bucket[i])
+	}
+
+	return hist
+}
+
+// Histograms returns the queue histograms.
+func (queue *Queue) Histograms() Histograms {
+	var h C.struct_quark_queue_histograms
+
+	C.quark_queue_get_histograms(queue.quarkQueue, &h)
+
+	return Histograms{
+		Ingest:    histogramToGo(&h.ingest),
+		Hold:      histogramToGo(&h.hold),
+		Depth:     histogramToGo(&h.depth),
+		FanIn:     histogramToGo(&h.fan_in),
+		CacheSize: histogramToGo(&h.cache_size),
+	}
+}
+
+// CPUStats returns the ring statistics of each cpu, indexed by cpu.
+func (queue *Queue) CPUStats() ([]CPUStats, error) {
+	n, err := C.quark_queue_get_cpu_stats(queue.quarkQueue, nil, 0)
+	if n == -1 {
+		return nil, wrapErrno(err)
+	}
+	if n == 0 {
+		return []CPUStats{}, nil
+	}
+	cstats := make([]C.struct_quark_cpu_stats, n)
+	n, err = C.quark_queue_get_cpu_stats(queue.quarkQueue, &cstats[0], n)
+	if n == -1 {
+		return nil, wrapErrno(err)
+	}
+	stats := make([]CPUStats, len(cstats))
+	for i, cs := range cstats {
+		stats[i] = CPUStats{
+			Lost:  uint64(cs.lost),
+			Sent:  uint64(cs.sent),
+			Bytes: uint64(cs.bytes),
+			Fill:  uint64(cs.fill),
+			Size:  uint64(cs.size),
+		}
+	}
+
+	return stats, nil
+}
+
+// Block blocks until there are events or timeout expires, a negative
+// timeout blocks indefinitely. The queue also wakes up when held events
+// are due. GetEvents should be called once Block returns.
+func (queue *Queue) Block(timeout time.Duration) error {
+	ms := -1
+	if timeout >= 0 {
+		// Round up, a sub-millisecond timeout isn't a busy poll
+		ms = int((timeout + time.Millisecond - 1) / time.Millisecond)
+	}
 	event := make([]syscall.EpollEvent, 1)
-	_, err := syscall.EpollWait(queue.epollFd, event, 100)
+	n, err := syscall.EpollWait(queue.epollFd, event, ms)
 	if err != nil && errors.Is(err, syscall.EINTR) {
 		err = nil
 	}
+	if n > 0 {
+		// Fd and Pad make up the epoll_data union
+		data := uint64(uint32(event[0].Fd)) | uint64(uint32(event[0].Pad))<<32
+		C.quark_queue_block_done(queue.quarkQueue, C.u64(data))
+	}
 	return err
 }
 
@@ -243,6 +494,20 @@ func (queue *Queue) Snapshot() []Process {
 	return processes
 }
 
+// Children returns all cached processes whose parent is pid.
+func (queue *Queue) Children(pid int) []Process {
+	var processes []Process
+	var iter C.struct_quark_process_iter
+
+	C.quark_process_children_iter_init(&iter, queue.quarkQueue, C.int(pid))
+
+	for qp := C.quark_process_iter_next(&iter); qp != nil; qp = C.quark_process_iter_next(&iter) {
+		processes = append(processes, processToGo(qp))
+	}
+
+	return processes
+}
+
 // processToGo converts the C process structure to a go process.
 func processToGo(cProcess *C.struct_quark_process) Process {
 	var process Process
@@ -286,25 +551,47 @@ func processToGo(cProcess *C.struct_quark_process) Process {
 	if cProcess.flags&C.QUARK_F_COMM != 0 {
 		process.Comm = C.GoString(&cProcess.comm[0])
 	}
-	if cProcess.flags&C.QUARK_F_FILENAME != 0 {
-		process.Filename = C.GoString(&cProcess.filename[0])
+	if filename := C.quark_process_filename(cProcess); filename != nil {
+		process.Filename = C.GoString(filename)
 	}
-	if cProcess.flags&C.QUARK_F_CMDLINE != 0 {
-		b := C.GoBytes(unsafe.Pointer(&cProcess.cmdline[0]), C.int(cProcess.cmdline_len))
+	var cmdlineLen C.size_t
+	if cmdline := C.quark_process_cmdline(cProcess, &cmdlineLen); cmdline != nil {
+		b := C.GoBytes(unsafe.Pointer(cmdline), C.int(cmdlineLen))
 		nul := string(byte(0))
 		b = bytes.TrimRight(b, nul)
 		process.Cmdline = strings.Split(string(b), nul)
 	}
-	if cProcess.flags&C.QUARK_F_CWD != 0 {
-		process.Cwd = C.GoString(&cProcess.cwd[0])
+	if cwd := C.quark_process_cwd(cProcess); cwd != nil {
+		process.Cwd = C.GoString(cwd)
 	}
 
 	return process
 }
 
+func threadToGo(cThread *C.struct_quark_thread) *Thread {
+	thread := &Thread{Tid: uint32(cThread.tid)}
+	if cThread.flags&C.QUARK_F_COMM != 0 {
+		thread.Comm = C.GoString(&cThread.comm[0])
+	}
+	if cThread.flags&C.QUARK_F_EXIT != 0 {
+		thread.Exit = Exit{
+			ExitCode:        int32(cThread.exit_code),
+			ExitTimeProcess: uint64(cThread.exit_time_event),
+			Valid:           true,
+		}
+	}
+
+	return thread
+}
+
 func eventToGo(cEvent *C.struct_quark_event) Event {
-	return Event{
+	event := Event{
 		Events:  uint64(cEvent.events),
 		Process: processToGo(cEvent.process),
 	}
+	if cEvent.thread != nil {
+		event.Thread = threadToGo(cEvent.thread)
+	}
+
+	return event
 }
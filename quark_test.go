@@ -1,9 +1,16 @@
 package quark
 
 import (
+	"fmt"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strconv"
 	"testing"
 
 	"github.com/stretchr/testify/require"
+
+	"github.com/mjwolf/quark/internal/bench"
 )
 
 func TestQuarkLookup(t *testing.T) {
@@ -21,6 +28,25 @@ func TestQuarkLookup(t *testing.T) {
 	require.NotEmpty(t, pid1.Cwd)
 }
 
+func TestQuarkChildren(t *testing.T) {
+	queue, err := OpenQueue(DefaultQueueAttr(), 64)
+	require.NoError(t, err)
+
+	defer queue.Close()
+
+	self, ok := queue.Lookup(os.Getpid())
+	require.True(t, ok)
+
+	found := false
+	for _, child := range queue.Children(int(self.Proc.Ppid)) {
+		require.Equal(t, self.Proc.Ppid, child.Proc.Ppid)
+		if child.Pid == self.Pid {
+			found = true
+		}
+	}
+	require.True(t, found)
+}
+
 func TestQuarkGetEvents(t *testing.T) {
 	queue, err := OpenQueue(DefaultQueueAttr(), 64)
 	require.NoError(t, err)
@@ -35,3 +61,201 @@ func TestQuarkGetEvents(t *testing.T) {
 		require.NotEmpty(t, qev.Process.Cwd)
 	}
 }
+
+func TestQuarkHistograms(t *testing.T) {
+	queue, err := OpenQueue(DefaultQueueAttr(), 64)
+	require.NoError(t, err)
+
+	defer queue.Close()
+
+	_, err = queue.GetEvents()
+	require.NoError(t, err)
+
+	h := queue.Histograms()
+	require.NotZero(t, h.Depth.Count)
+	require.NotZero(t, h.CacheSize.Count)
+	for _, hist := range []Histogram{h.Ingest, h.Hold, h.Depth, h.FanIn, h.CacheSize} {
+		var n uint64
+		for _, v := range hist.Bucket {
+			n += v
+		}
+		require.Equal(t, hist.Count, n)
+	}
+}
+
+func BenchmarkQuarkProcessCache(b *testing.B) {
+	var stats Stats
+
+	for i := 0; i < b.N; i++ {
+		queue, err := OpenQueue(DefaultQueueAttr(), 1)
+		require.NoError(b, err)
+		stats = queue.Stats()
+		queue.Close()
+	}
+
+	require.NotZero(b, stats.CacheEntries)
+	// Baseline, the same cache with the strings inline
+	inline := bench.InlineCacheBytes(stats.CacheBytes, stats.StrtabBytes, stats.CacheEntries)
+	b.ReportMetric(float64(inline)/float64(stats.CacheEntries), "inline-B/process")
+	b.ReportMetric(float64(stats.CacheBytes)/float64(stats.CacheEntries), "B/process")
+	b.ReportMetric(float64(stats.StrtabSaved)/float64(stats.CacheEntries), "shared-B/process")
+}
+
+func BenchmarkOpenQueue(b *testing.B) {
+	for _, threads := range []int{1, 2, 4, 8} {
+		b.Run(fmt.Sprintf("threads/%d", threads), func(b *testing.B) {
+			attr := DefaultQueueAttr()
+			attr.ScrapeThreads = threads
+
+			for i := 0; i < b.N; i++ {
+				queue, err := OpenQueue(attr, 1)
+				require.NoError(b, err)
+				queue.Close()
+			}
+		})
+	}
+}
+
+// captureProc copies status, stat and cmdline of every readable pid into
+// dir/0, dir/1 and so on, returns how many were captured.
+func captureProc(dir string) (int, error) {
+	entries, err := os.ReadDir("/proc")
+	if err != nil {
+		return 0, err
+	}
+	n := 0
+	for _, entry := range entries {
+		if _, err := strconv.Atoi(entry.Name()); err != nil {
+			continue
+		}
+		var files [][]byte
+		for _, name := range []string{"status", "stat", "cmdline"} {
+			data, err := os.ReadFile(filepath.Join("/proc", entry.Name(), name))
+			if err != nil {
+				break
+			}
+			files = append(files, data)
+		}
+		if len(files) != 3 {
+			continue
+		}
+		pidDir := filepath.Join(dir, strconv.Itoa(n))
+		if err := os.Mkdir(pidDir, 0o755); err != nil {
+			return 0, err
+		}
+		for i, name := range []string{"status", "stat", "cmdline"} {
+			if err := os.WriteFile(filepath.Join(pidDir, name), files[i], 0o644); err != nil {
+				return 0, err
+			}
+		}
+		n++
+	}
+
+	return n, nil
+}
+
+func BenchmarkProcParsers(b *testing.B) {
+	corpus := b.TempDir()
+	npids, err := captureProc(corpus)
+	require.NoError(b, err)
+	require.NotZero(b, npids)
+
+	for _, kind := range []string{"stdio", "quark"} {
+		b.Run(kind, func(b *testing.B) {
+			b.ResetTimer()
+			require.Zero(b, bench.Sproc(corpus, npids, kind == "stdio", b.N))
+			b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(b.N*npids), "ns/pid")
+		})
+	}
+}
+
+func BenchmarkProcessCacheIndex(b *testing.B) {
+	for _, kind := range []string{"index", "rbtree"} {
+		for _, n := range []int{10000, 100000, 1000000} {
+			b.Run(fmt.Sprintf("insert/%s/%d", kind, n), func(b *testing.B) {
+				bc := bench.NewCache(n, kind == "rbtree")
+				defer bc.Free()
+
+				b.ResetTimer()
+				for i := 0; i < b.N; i++ {
+					bc.Insert()
+					b.StopTimer()
+					bc.Reset()
+					b.StartTimer()
+				}
+				b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(b.N*n), "ns/insert")
+			})
+			b.Run(fmt.Sprintf("lookup/%s/%d", kind, n), func(b *testing.B) {
+				bc := bench.NewCache(n, kind == "rbtree")
+				defer bc.Free()
+				bc.Insert()
+
+				b.ResetTimer()
+				require.Equal(b, uint64(b.N), bc.Lookup(b.N))
+			})
+		}
+	}
+}
+
+func BenchmarkRawEventInsert(b *testing.B) {
+	for _, ties := range []bool{false, true} {
+		for _, n := range []int{10000, 100000} {
+			name := fmt.Sprintf("unique/%d", n)
+			if ties {
+				name = fmt.Sprintf("ties/%d", n)
+			}
+			b.Run(name, func(b *testing.B) {
+				bq := bench.NewQueue(n, ties)
+				defer bq.Free()
+
+				b.ResetTimer()
+				for i := 0; i < b.N; i++ {
+					bq.Insert()
+				}
+				b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(b.N*n), "ns/insert")
+			})
+		}
+	}
+}
+
+func BenchmarkHoldQueue(b *testing.B) {
+	for _, kind := range []string{"rbtree", "heap"} {
+		for _, n := range []int{10000, 100000, 1000000} {
+			b.Run(fmt.Sprintf("%s/%d", kind, n), func(b *testing.B) {
+				bh := bench.NewHold(n, kind == "heap")
+				defer bh.Free()
+
+				b.ResetTimer()
+				bh.Churn(b.N)
+				b.StopTimer()
+			})
+		}
+	}
+}
+
+// BenchmarkForkLatency measures fork+exec+exit of a short lived process while
+// the kprobe backend fetches every field or only the ones it can't do
+// without.
+func BenchmarkForkLatency(b *testing.B) {
+	for _, profile := range []string{"full", "minimal"} {
+		b.Run(profile, func(b *testing.B) {
+			attr := DefaultQueueAttr()
+			attr.Flags = (attr.Flags &^ QQ_ALL_BACKENDS) | QQ_KPROBE
+			if profile == "minimal" {
+				attr.FieldMask = QUARK_F_PROC
+			}
+			queue, err := OpenQueue(attr, 64)
+			require.NoError(b, err)
+			defer queue.Close()
+
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				require.NoError(b, exec.Command("/bin/true").Run())
+				b.StopTimer()
+				_, err = queue.GetEvents()
+				require.NoError(b, err)
+				b.StartTimer()
+			}
+		})
+	}
+}